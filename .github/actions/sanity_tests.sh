@@ -1,6 +1,11 @@
 set -e
 
-./build/bin/tester/sameboy_tester --jobs 5 \
+for MODE in "" "--cached-interpreter"; do
+
+# Results from the previous mode must not pass for this one
+rm -f .github/actions/*.bmp
+
+./build/bin/tester/sameboy_tester $MODE --jobs 5 \
       --length 45 .github/actions/cgb_sound.gb \
       --length 10  .github/actions/cgb-acid2.gbc \
       --length 10  .github/actions/dmg-acid2.gb \
@@ -9,11 +14,24 @@ set -e
 
 mv .github/actions/dmg{,-mode}-acid2.bmp
 
-./build/bin/tester/sameboy_tester \
+./build/bin/tester/sameboy_tester $MODE \
 --dmg --length 10  .github/actions/dmg-acid2.gb 
 
 set +e
 
+MISSING_TESTS=""
+for TEST in cgb-acid2 cgb_sound dmg-acid2 dmg-mode-acid2 dmg_sound-2 oam_bug-2; do
+    if [ ! -f .github/actions/$TEST.bmp ] ; then
+        MISSING_TESTS="$MISSING_TESTS $TEST"
+    fi
+done
+
+if [ -n "$MISSING_TESTS" ] ; then
+    echo "The following tests did not produce a result${MODE:+ ($MODE)}:"
+    echo $MISSING_TESTS | tr " " "\n"
+    exit 1
+fi
+
 FAILED_TESTS=`
 shasum .github/actions/*.bmp | grep -E -v \(\
 64c3fd9a5fe9aee40fe15f3371029c0d2f20f5bc\ \ .github/actions/cgb-acid2.bmp\|\
@@ -25,9 +43,13 @@ f0172cc91867d3343fbd113a2bb98100074be0de\ \ .github/actions/oam_bug-2.bmp\
 \)`
 
 if [ -n "$FAILED_TESTS" ] ; then
-    echo "Failed the following tests:"
+    echo "Failed the following tests${MODE:+ ($MODE)}:"
     echo $FAILED_TESTS | tr " " "\n" | grep -o -E "[^/]+\.bmp" | sed s/.bmp// | sort
     exit 1
 fi
 
-echo Passed all tests
\ No newline at end of file
+set -e
+
+done
+
+echo Passed all tests
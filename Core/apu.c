@@ -2,6 +2,9 @@
 #include <math.h>
 #include <string.h>
 #include "gb.h"
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #define likely(x)   __builtin_expect((x), 1)
 #define unlikely(x) __builtin_expect((x), 0)
@@ -21,6 +24,73 @@ static void refresh_channel(GB_gameboy_t *gb, unsigned index, unsigned cycles_of
     gb->apu_output.last_update[index] = gb->apu_output.cycles_since_render + cycles_offset;
 }
 
+/* Windowed sinc impulses in 1.15 fixed point, one row per fractional output sample position. Each row sums to exactly
+   1 << 15, so integrating them moves the output by the exact step size and never accumulates rounding errors. */
+static int16_t blep_kernels[GB_BLEP_PHASES][GB_BLEP_TAPS];
+
+static void init_blep_kernels(void)
+{
+    static bool initialized = false;
+    if (initialized) return;
+
+    const double cutoff = 0.9; // Relative to the output Nyquist frequency
+    for (unsigned phase = 0; phase < GB_BLEP_PHASES; phase++) {
+        double taps[GB_BLEP_TAPS];
+        double sum = 0;
+        for (unsigned i = 0; i < GB_BLEP_TAPS; i++) {
+            double x = (int)i + 1 - GB_BLEP_TAPS / 2 - phase / (double)GB_BLEP_PHASES;
+            double window = 0.42 + 0.5 * cos(M_PI * x / (GB_BLEP_TAPS / 2)) + 0.08 * cos(2 * M_PI * x / (GB_BLEP_TAPS / 2));
+            taps[i] = (x == 0? cutoff : sin(M_PI * cutoff * x) / (M_PI * x)) * window;
+            sum += taps[i];
+        }
+        int total = 0;
+        for (unsigned i = 0; i < GB_BLEP_TAPS; i++) {
+            blep_kernels[phase][i] = round(taps[i] / sum * 0x8000);
+            total += blep_kernels[phase][i];
+        }
+        /* Put the rounding error on the largest tap */
+        blep_kernels[phase][GB_BLEP_TAPS / 2 - 1 + (phase >= GB_BLEP_PHASES / 2)] += 0x8000 - total;
+    }
+    initialized = true;
+}
+
+static void set_blep_level(GB_gameboy_t *gb, unsigned index, unsigned cycles_offset)
+{
+    int32_t left = gb->apu_output.current_sample[index].left * (int32_t)gb->apu_output.dac_multiplier[index] >> 16;
+    int32_t right = gb->apu_output.current_sample[index].right * (int32_t)gb->apu_output.dac_multiplier[index] >> 16;
+    int32_t delta_left = left - gb->apu_output.blep_level[index][0];
+    int32_t delta_right = right - gb->apu_output.blep_level[index][1];
+    if (!delta_left && !delta_right) return;
+    gb->apu_output.blep_level[index][0] = left;
+    gb->apu_output.blep_level[index][1] = right;
+
+    /* cycles_offset may be negative, wrapping as an unsigned */
+    int ticks = (int)(gb->apu_output.cycles_since_render + cycles_offset);
+    uint64_t position = gb->apu_output.blep_phase + (ticks > 0? ticks * gb->apu_output.blep_step : 0);
+    unsigned offset = position >> 32;
+    if (unlikely(offset > GB_BLEP_BUFFER_LENGTH - GB_BLEP_TAPS)) {
+        offset = GB_BLEP_BUFFER_LENGTH - GB_BLEP_TAPS;
+    }
+    const int16_t *kernel = blep_kernels[(uint32_t)position / (0x100000000 / GB_BLEP_PHASES)];
+    offset += gb->apu_output.blep_head;
+    for (unsigned i = 0; i < GB_BLEP_TAPS; i++) {
+        int32_t *slot = gb->apu_output.blep_buffer[(offset + i) & (GB_BLEP_BUFFER_LENGTH - 1)];
+        slot[0] += delta_left * kernel[i];
+        slot[1] += delta_right * kernel[i];
+    }
+}
+
+static void set_current_sample(GB_gameboy_t *gb, unsigned index, GB_sample_t output, unsigned cycles_offset)
+{
+    if (gb->apu_output.resampling_mode == GB_AUDIO_RESAMPLING_BAND_LIMITED) {
+        gb->apu_output.current_sample[index] = output;
+        set_blep_level(gb, index, cycles_offset);
+        return;
+    }
+    refresh_channel(gb, index, cycles_offset);
+    gb->apu_output.current_sample[index] = output;
+}
+
 bool GB_apu_is_DAC_enabled(GB_gameboy_t *gb, unsigned index)
 {
     if (gb->model >= GB_MODEL_AGB) {
@@ -75,8 +145,7 @@ static void update_sample(GB_gameboy_t *gb, unsigned index, int8_t value, unsign
             }
             
             if (*(uint32_t *)&(gb->apu_output.current_sample[index]) != *(uint32_t *)&output) {
-                refresh_channel(gb, index, cycles_offset);
-                gb->apu_output.current_sample[index] = output;
+                set_current_sample(gb, index, output, cycles_offset);
             }
         }
         
@@ -101,111 +170,217 @@ static void update_sample(GB_gameboy_t *gb, unsigned index, int8_t value, unsign
         }
         GB_sample_t output = {(0xf - value * 2) * left_volume, (0xf - value * 2) * right_volume};
         if (*(uint32_t *)&(gb->apu_output.current_sample[index]) != *(uint32_t *)&output) {
-            refresh_channel(gb, index, cycles_offset);
-            gb->apu_output.current_sample[index] = output;
+            set_current_sample(gb, index, output, cycles_offset);
+        }
+    }
+}
+
+static inline int32_t mul_q31(int32_t a, int32_t b)
+{
+    return ((int64_t)a * b) >> 31;
+}
+
+/* Runs the highpass filter over a block of samples in place. The filter's level follows
+   diff[n] = rate * diff[n - 1] + (1 - rate) * input[n], which is solved 4 samples at a time as a prefix sum, so it
+   doesn't depend on the previous sample at every step. The NEON and portable versions round identically. */
+static void highpass_block(GB_gameboy_t *gb, GB_sample_t *samples, const GB_sample_t *inputs, unsigned count)
+{
+    const int32_t *rate = gb->apu_output.highpass_rate;
+    const int32_t step = 0x80000000 - rate[0];
+    int32_t *diff = gb->apu_output.highpass_diff;
+    unsigned n = 0;
+
+#ifdef __ARM_NEON
+    const int32x4_t rate_powers = vld1q_s32(rate);
+    const int32x4_t zero = vdupq_n_s32(0);
+    for (; n + 4 <= count; n += 4) {
+        int16x4x2_t output = vld2_s16((const int16_t *)(samples + n));
+        int16x4x2_t input = vld2_s16((const int16_t *)(inputs + n));
+        UNROLL
+        for (unsigned i = 0; i < 2; i++) {
+            int32x4_t levels = vqdmulhq_n_s32(vshlq_n_s32(vmovl_s16(input.val[i]), 15), step);
+            levels = vaddq_s32(levels, vqdmulhq_n_s32(vextq_s32(zero, levels, 3), rate[0]));
+            levels = vaddq_s32(levels, vqdmulhq_n_s32(vextq_s32(zero, levels, 2), rate[1]));
+            int32x4_t previous = vdupq_n_s32(diff[i]);
+            levels = vaddq_s32(levels, vqdmulhq_s32(previous, rate_powers));
+            int32x4_t filtered = vsubq_s32(vmovl_s16(output.val[i]), vrshrq_n_s32(vextq_s32(previous, levels, 3), 15));
+            output.val[i] = vmovn_s32(filtered);
+            diff[i] = vgetq_lane_s32(levels, 3);
         }
+        vst2_s16((int16_t *)(samples + n), output);
+    }
+#else
+    for (; n + 4 <= count; n += 4) {
+        UNROLL
+        for (unsigned i = 0; i < 2; i++) {
+            int32_t levels[4];
+            for (unsigned j = 0; j < 4; j++) {
+                levels[j] = mul_q31((i? inputs[n + j].right : inputs[n + j].left) * 0x8000, step);
+            }
+            for (unsigned j = 3; j >= 1; j--) {
+                levels[j] += mul_q31(levels[j - 1], rate[0]);
+            }
+            for (unsigned j = 3; j >= 2; j--) {
+                levels[j] += mul_q31(levels[j - 2], rate[1]);
+            }
+            int32_t previous = diff[i];
+            for (unsigned j = 0; j < 4; j++) {
+                levels[j] += mul_q31(previous, rate[j]);
+                int16_t *sample = i? &samples[n + j].right : &samples[n + j].left;
+                *sample -= ((j? levels[j - 1] : previous) + 0x4000) >> 15;
+            }
+            diff[i] = levels[3];
+        }
+    }
+#endif
+
+    for (; n < count; n++) {
+        int32_t left = mul_q31(inputs[n].left * 0x8000, step) + mul_q31(diff[0], rate[0]);
+        int32_t right = mul_q31(inputs[n].right * 0x8000, step) + mul_q31(diff[1], rate[0]);
+        samples[n].left -= (diff[0] + 0x4000) >> 15;
+        samples[n].right -= (diff[1] + 0x4000) >> 15;
+        diff[0] = left;
+        diff[1] = right;
     }
 }
 
-static void render(GB_gameboy_t *gb, bool no_downsampling, GB_sample_t *dest)
+static void flush_block(GB_gameboy_t *gb)
 {
-    GB_sample_t output = {0,0};
+    GB_sample_t *block = gb->apu_output.block;
+    unsigned length = gb->apu_output.block_length;
+    gb->apu_output.block_length = 0;
+
+    switch (gb->apu_output.block_highpass_mode) {
+        case GB_HIGHPASS_ACCURATE: {
+            /* The filter's input is the output itself, so it needs a copy */
+            GB_sample_t inputs[GB_APU_BLOCK_LENGTH];
+            memcpy(inputs, block, length * sizeof(block[0]));
+            highpass_block(gb, block, inputs, length);
+            break;
+        }
+        case GB_HIGHPASS_REMOVE_DC_OFFSET:
+            highpass_block(gb, block, gb->apu_output.block_dc_levels, length);
+            break;
+        default:
+            gb->apu_output.highpass_diff[0] = gb->apu_output.highpass_diff[1] = 0;
+            break;
+    }
+
+    size_t write_position = gb->apu_output.write_position;
+    size_t read_position = __atomic_load_n(&gb->apu_output.read_position, __ATOMIC_ACQUIRE);
+    size_t buffer_size = __atomic_load_n(&gb->apu_output.buffer_size, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < length && write_position - read_position < buffer_size; i++) {
+        gb->apu_output.buffer[write_position++ & (gb->apu_output.buffer_capacity - 1)] = block[i];
+    }
+    __atomic_store_n(&gb->apu_output.write_position, write_position, __ATOMIC_RELEASE);
+
+    if (length) {
+        uint32_t last_sample;
+        memcpy(&last_sample, &block[length - 1], sizeof(last_sample));
+        __atomic_store_n(&gb->apu_output.last_sample, last_sample, __ATOMIC_RELAXED);
+    }
+}
+
+static void render(GB_gameboy_t *gb)
+{
+    /* 16.16 fixed point */
+    int32_t left = 0, right = 0;
+    /* Channels that changed since the last sample are averaged over it, by multiplying with the reciprocal of
+       cycles_since_render in 8.24 fixed point */
+    int64_t averaged_left = 0, averaged_right = 0;
+    int64_t reciprocal = gb->apu_output.cycles_since_render? 0x1000000 / gb->apu_output.cycles_since_render : 0;
 
     UNROLL
     for (unsigned i = 0; i < GB_N_CHANNELS; i++) {
-        double multiplier = CH_STEP;
+        uint32_t multiplier = CH_STEP * 0x10000;
         
         if (gb->model < GB_MODEL_AGB) {
             if (!GB_apu_is_DAC_enabled(gb, i)) {
-                gb->apu_output.dac_discharge[i] -= ((double) DAC_DECAY_SPEED) / gb->apu_output.sample_rate;
-                if (gb->apu_output.dac_discharge[i] < 0) {
-                    multiplier = 0;
-                    gb->apu_output.dac_discharge[i] = 0;
+                if (gb->apu_output.dac_discharge[i] > gb->apu_output.dac_decay_step) {
+                    gb->apu_output.dac_discharge[i] -= gb->apu_output.dac_decay_step;
                 }
                 else {
-                    multiplier *= gb->apu_output.dac_discharge[i];
+                    gb->apu_output.dac_discharge[i] = 0;
                 }
             }
             else {
-                gb->apu_output.dac_discharge[i] += ((double) DAC_ATTACK_SPEED) / gb->apu_output.sample_rate;
-                if (gb->apu_output.dac_discharge[i] > 1) {
-                    gb->apu_output.dac_discharge[i] = 1;
-                }
-                else {
-                    multiplier *= gb->apu_output.dac_discharge[i];
-                }
+                gb->apu_output.dac_discharge[i] = MIN(gb->apu_output.dac_discharge[i] + gb->apu_output.dac_attack_step,
+                                                      0x10000);
             }
+            multiplier = CH_STEP * gb->apu_output.dac_discharge[i];
         }
 
-        if (likely(gb->apu_output.last_update[i] == 0 || no_downsampling)) {
-            output.left += gb->apu_output.current_sample[i].left * multiplier;
-            output.right += gb->apu_output.current_sample[i].right * multiplier;
+        if (gb->apu_output.resampling_mode == GB_AUDIO_RESAMPLING_BAND_LIMITED) {
+            if (gb->apu_output.dac_multiplier[i] != multiplier) {
+                /* DAC fades are slow enough to be placed as steps at sample boundaries */
+                gb->apu_output.dac_multiplier[i] = multiplier;
+                set_blep_level(gb, i, 0);
+            }
+            continue;
+        }
+        gb->apu_output.dac_multiplier[i] = multiplier;
+
+        if (likely(gb->apu_output.last_update[i] == 0)) {
+            left += gb->apu_output.current_sample[i].left * (int32_t)multiplier;
+            right += gb->apu_output.current_sample[i].right * (int32_t)multiplier;
         }
         else {
             refresh_channel(gb, i, 0);
-            output.left += (signed long) gb->apu_output.summed_samples[i].left * multiplier
-                            / gb->apu_output.cycles_since_render;
-            output.right += (signed long) gb->apu_output.summed_samples[i].right * multiplier
-                            / gb->apu_output.cycles_since_render;
+            averaged_left += (int64_t)gb->apu_output.summed_samples[i].left * multiplier;
+            averaged_right += (int64_t)gb->apu_output.summed_samples[i].right * multiplier;
             gb->apu_output.summed_samples[i] = (GB_sample_t){0, 0};
         }
         gb->apu_output.last_update[i] = 0;
     }
     gb->apu_output.cycles_since_render = 0;
 
-    GB_sample_t filtered_output = gb->apu_output.highpass_mode?
-        (GB_sample_t) {output.left - gb->apu_output.highpass_diff.left,
-                       output.right - gb->apu_output.highpass_diff.right} :
-        output;
+    GB_sample_t output = {(left + ((averaged_left * reciprocal) >> 24)) >> 16,
+                          (right + ((averaged_right * reciprocal) >> 24)) >> 16};
+
+    if (gb->apu_output.resampling_mode == GB_AUDIO_RESAMPLING_BAND_LIMITED) {
+        int32_t *slot = gb->apu_output.blep_buffer[gb->apu_output.blep_head];
+        gb->apu_output.blep_integrator[0] += slot[0];
+        gb->apu_output.blep_integrator[1] += slot[1];
+        slot[0] = slot[1] = 0;
+        gb->apu_output.blep_head = (gb->apu_output.blep_head + 1) & (GB_BLEP_BUFFER_LENGTH - 1);
+        /* Samples are rendered up to a CPU step late, time the next steps from when this one was actually due */
+        gb->apu_output.blep_phase = (gb->apu_output.sample_cycles >> 16) * (gb->apu_output.blep_step >> 2) >> 16;
+        output.left = (gb->apu_output.blep_integrator[0] + 0x4000) >> 15;
+        output.right = (gb->apu_output.blep_integrator[1] + 0x4000) >> 15;
+    }
 
-    switch (gb->apu_output.highpass_mode) {
-        case GB_HIGHPASS_OFF:
-            gb->apu_output.highpass_diff = (GB_double_sample_t) {0, 0};
-            break;
-        case GB_HIGHPASS_ACCURATE:
-            gb->apu_output.highpass_diff = (GB_double_sample_t)
-                {output.left - filtered_output.left * gb->apu_output.highpass_rate,
-                    output.right - filtered_output.right * gb->apu_output.highpass_rate};
-            break;
-        case GB_HIGHPASS_REMOVE_DC_OFFSET: {
-            unsigned mask = gb->io_registers[GB_IO_NR51];
-            unsigned left_volume = 0;
-            unsigned right_volume = 0;
-            UNROLL
-            for (unsigned i = GB_N_CHANNELS; i--;) {
-                if (gb->apu.is_active[i]) {
-                    if (mask & 1) {
-                        left_volume += (gb->io_registers[GB_IO_NR50] & 7) * CH_STEP * 0xF;
-                    }
-                    if (mask & 0x10) {
-                        right_volume += ((gb->io_registers[GB_IO_NR50] >> 4) & 7) * CH_STEP * 0xF;
-                    }
+    if (gb->apu_output.block_length && gb->apu_output.block_highpass_mode != gb->apu_output.highpass_mode) {
+        flush_block(gb);
+    }
+    gb->apu_output.block_highpass_mode = gb->apu_output.highpass_mode;
+
+    if (gb->apu_output.highpass_mode == GB_HIGHPASS_REMOVE_DC_OFFSET) {
+        unsigned mask = gb->io_registers[GB_IO_NR51];
+        int32_t left_volume = 0;
+        int32_t right_volume = 0;
+        UNROLL
+        for (unsigned i = GB_N_CHANNELS; i--;) {
+            if (gb->apu.is_active[i]) {
+                if (mask & 1) {
+                    left_volume += (gb->io_registers[GB_IO_NR50] & 7) * CH_STEP * 0xF;
                 }
-                else {
-                    left_volume += gb->apu_output.current_sample[i].left * CH_STEP;
-                    right_volume += gb->apu_output.current_sample[i].right * CH_STEP;
+                if (mask & 0x10) {
+                    right_volume += ((gb->io_registers[GB_IO_NR50] >> 4) & 7) * CH_STEP * 0xF;
                 }
-                mask >>= 1;
             }
-            gb->apu_output.highpass_diff = (GB_double_sample_t)
-            {left_volume * (1 - gb->apu_output.highpass_rate) + gb->apu_output.highpass_diff.left * gb->apu_output.highpass_rate,
-                right_volume * (1 - gb->apu_output.highpass_rate) + gb->apu_output.highpass_diff.right * gb->apu_output.highpass_rate};
-
-        case GB_HIGHPASS_MAX:;
+            else {
+                left_volume += gb->apu_output.current_sample[i].left * CH_STEP;
+                right_volume += gb->apu_output.current_sample[i].right * CH_STEP;
+            }
+            mask >>= 1;
         }
-
-    }
-    if (dest) {
-        *dest = filtered_output;
-        return;
+        gb->apu_output.block_dc_levels[gb->apu_output.block_length] = (GB_sample_t){left_volume, right_volume};
     }
 
-    while (gb->apu_output.copy_in_progress);
-    while (!__sync_bool_compare_and_swap(&gb->apu_output.lock, false, true));
-    if (gb->apu_output.buffer_position < gb->apu_output.buffer_size) {
-        gb->apu_output.buffer[gb->apu_output.buffer_position++] = filtered_output;
+    gb->apu_output.block[gb->apu_output.block_length++] = output;
+    if (gb->apu_output.block_length == GB_APU_BLOCK_LENGTH) {
+        flush_block(gb);
     }
-    gb->apu_output.lock = false;
 }
 
 static uint16_t new_sweep_sample_legnth(GB_gameboy_t *gb)
@@ -505,52 +680,85 @@ void GB_apu_run(GB_gameboy_t *gb)
 
         if (gb->apu_output.sample_cycles > gb->apu_output.cycles_per_sample) {
             gb->apu_output.sample_cycles -= gb->apu_output.cycles_per_sample;
-            render(gb, false, NULL);
+            render(gb);
         }
     }
 }
 
+/* How many 8MHz cycles the APU can run for in a single batch with the same result as running it in smaller steps,
+   meaning no channel changes its sample and no output sample is rendered. */
+unsigned GB_apu_batchable_cycles(GB_gameboy_t *gb)
+{
+    unsigned cycles = 0xFFFF; // In 2 MHz
+    
+    if (gb->apu.square_sweep_calculate_countdown) {
+        cycles = gb->apu.square_sweep_calculate_countdown - 1;
+    }
+    for (unsigned i = GB_SQUARE_1; i <= GB_SQUARE_2; i++) {
+        if (gb->apu.is_active[i]) {
+            cycles = MIN(cycles, gb->apu.square_channels[i].sample_countdown);
+        }
+    }
+    if (gb->apu.is_active[GB_WAVE]) {
+        cycles = MIN(cycles, gb->apu.wave_channel.sample_countdown);
+    }
+    if (gb->apu.is_active[GB_NOISE]) {
+        cycles = MIN(cycles, gb->apu.noise_channel.sample_countdown);
+    }
+    cycles *= 4;
+    
+    if (gb->apu_output.sample_rate) {
+        if (gb->apu_output.sample_cycles >= gb->apu_output.cycles_per_sample) return 0;
+        cycles = MIN(cycles, (unsigned)((gb->apu_output.cycles_per_sample - gb->apu_output.sample_cycles) >> 32));
+    }
+    
+    return cycles;
+}
+
 void GB_apu_copy_buffer(GB_gameboy_t *gb, GB_sample_t *dest, size_t count)
 {
     if (gb->sgb) {
         if (GB_sgb_render_jingle(gb, dest, count)) return;
     }
-    gb->apu_output.copy_in_progress = true;
 
-    /* TODO: Rewrite this as a proper cyclic buffer. This is a workaround to avoid a very rare crashing race condition */
-    size_t buffer_position = gb->apu_output.buffer_position;
+    size_t read_position = gb->apu_output.read_position;
+    size_t available = __atomic_load_n(&gb->apu_output.write_position, __ATOMIC_ACQUIRE) - read_position;
 
     if (!gb->apu_output.stream_started) {
         // Intentionally fail the first copy to sync the stream with the Gameboy.
         gb->apu_output.stream_started = true;
-        gb->apu_output.buffer_position = 0;
-        buffer_position = 0;
+        read_position += available;
+        available = 0;
     }
 
-    if (count > buffer_position) {
-        // GB_log(gb, "Audio underflow: %d\n", count - gb->apu_output.buffer_position);
+    if (count > available) {
+        // GB_log(gb, "Audio underflow: %d\n", count - available);
+        /* Never render from here, the emulation thread owns the APU state. Repeat the last sample it produced. */
+        uint32_t last_sample = __atomic_load_n(&gb->apu_output.last_sample, __ATOMIC_RELAXED);
         GB_sample_t output;
-        render(gb, true, &output);
+        memcpy(&output, &last_sample, sizeof(output));
 
-        for (unsigned i = 0; i < count - buffer_position; i++) {
-            dest[buffer_position + i] = output;
+        for (unsigned i = 0; i < count - available; i++) {
+            dest[available + i] = output;
         }
 
-        if (buffer_position) {
-            if (gb->apu_output.buffer_size + (count - buffer_position) < count * 3) {
-                gb->apu_output.buffer_size += count - buffer_position;
-                gb->apu_output.buffer = realloc(gb->apu_output.buffer,
-                                                gb->apu_output.buffer_size * sizeof(*gb->apu_output.buffer));
+        if (available) {
+            size_t buffer_size = gb->apu_output.buffer_size;
+            if (buffer_size + (count - available) < count * 3) {
+                buffer_size = MIN(buffer_size + (count - available), gb->apu_output.buffer_capacity);
+                __atomic_store_n(&gb->apu_output.buffer_size, buffer_size, __ATOMIC_RELAXED);
                 gb->apu_output.stream_started = false;
             }
         }
-        count = buffer_position;
+        count = available;
     }
-    memcpy(dest, gb->apu_output.buffer, count * sizeof(*gb->apu_output.buffer));
-    memmove(gb->apu_output.buffer, gb->apu_output.buffer + count, (buffer_position - count) * sizeof(*gb->apu_output.buffer));
-    gb->apu_output.buffer_position -= count;
 
-    gb->apu_output.copy_in_progress = false;
+    /* At most two copies, as the samples might wrap around the end of the buffer */
+    size_t start = read_position & (gb->apu_output.buffer_capacity - 1);
+    size_t first = MIN(count, gb->apu_output.buffer_capacity - start);
+    memcpy(dest, gb->apu_output.buffer + start, first * sizeof(*gb->apu_output.buffer));
+    memcpy(dest + first, gb->apu_output.buffer, (count - first) * sizeof(*gb->apu_output.buffer));
+    __atomic_store_n(&gb->apu_output.read_position, read_position + count, __ATOMIC_RELEASE);
 }
 
 void GB_apu_init(GB_gameboy_t *gb)
@@ -1012,7 +1220,13 @@ void GB_apu_write(GB_gameboy_t *gb, uint8_t reg, uint8_t value)
 
 size_t GB_apu_get_current_buffer_length(GB_gameboy_t *gb)
 {
-    return gb->apu_output.buffer_position;
+    size_t read_position = __atomic_load_n(&gb->apu_output.read_position, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&gb->apu_output.write_position, __ATOMIC_ACQUIRE) - read_position;
+}
+
+size_t GB_apu_get_buffer_size(GB_gameboy_t *gb)
+{
+    return __atomic_load_n(&gb->apu_output.buffer_size, __ATOMIC_RELAXED);
 }
 
 void GB_set_sample_rate(GB_gameboy_t *gb, unsigned int sample_rate)
@@ -1021,11 +1235,23 @@ void GB_set_sample_rate(GB_gameboy_t *gb, unsigned int sample_rate)
         free(gb->apu_output.buffer);
     }
     gb->apu_output.buffer_size = sample_rate / 25; // 40ms delay
-    gb->apu_output.buffer = malloc(gb->apu_output.buffer_size * sizeof(*gb->apu_output.buffer));
+    /* Underflows may grow the buffer up to half a second, it's never reallocated while a copy might be in progress */
+    gb->apu_output.buffer_capacity = 1;
+    while (gb->apu_output.buffer_capacity < sample_rate / 2) {
+        gb->apu_output.buffer_capacity <<= 1;
+    }
+    gb->apu_output.buffer = malloc(gb->apu_output.buffer_capacity * sizeof(*gb->apu_output.buffer));
     gb->apu_output.sample_rate = sample_rate;
-    gb->apu_output.buffer_position = 0;
+    gb->apu_output.read_position = gb->apu_output.write_position = 0;
+    gb->apu_output.block_length = 0;
+    gb->apu_output.last_sample = 0;
     if (sample_rate) {
-        gb->apu_output.highpass_rate = pow(0.999958,  GB_get_clock_rate(gb) / (double)sample_rate);
+        double highpass_rate = pow(0.999958,  GB_get_clock_rate(gb) / (double)sample_rate);
+        for (unsigned i = 0; i < 4; i++) {
+            gb->apu_output.highpass_rate[i] = pow(highpass_rate, i + 1) * 0x80000000;
+        }
+        gb->apu_output.dac_attack_step = ((uint64_t)DAC_ATTACK_SPEED << 16) / sample_rate;
+        gb->apu_output.dac_decay_step = ((uint64_t)DAC_DECAY_SPEED << 16) / sample_rate;
     }
     GB_apu_update_cycles_per_sample(gb);
 }
@@ -1035,9 +1261,32 @@ void GB_set_highpass_filter_mode(GB_gameboy_t *gb, GB_highpass_mode_t mode)
     gb->apu_output.highpass_mode = mode;
 }
 
+void GB_set_audio_resampling_mode(GB_gameboy_t *gb, GB_audio_resampling_mode_t mode)
+{
+    if (mode == GB_AUDIO_RESAMPLING_BAND_LIMITED) {
+        init_blep_kernels();
+    }
+
+    /* Restart both resamplers from the current levels, so switching doesn't add a step */
+    memset(gb->apu_output.blep_buffer, 0, sizeof(gb->apu_output.blep_buffer));
+    gb->apu_output.blep_integrator[0] = gb->apu_output.blep_integrator[1] = 0;
+    for (unsigned i = 0; i < GB_N_CHANNELS; i++) {
+        gb->apu_output.blep_level[i][0] = gb->apu_output.current_sample[i].left * (int32_t)gb->apu_output.dac_multiplier[i] >> 16;
+        gb->apu_output.blep_level[i][1] = gb->apu_output.current_sample[i].right * (int32_t)gb->apu_output.dac_multiplier[i] >> 16;
+        gb->apu_output.blep_integrator[0] += gb->apu_output.blep_level[i][0] * 0x8000;
+        gb->apu_output.blep_integrator[1] += gb->apu_output.blep_level[i][1] * 0x8000;
+        gb->apu_output.summed_samples[i] = (GB_sample_t){0, 0};
+        gb->apu_output.last_update[i] = 0;
+    }
+    gb->apu_output.resampling_mode = mode;
+}
+
 void GB_apu_update_cycles_per_sample(GB_gameboy_t *gb)
 {
     if (gb->apu_output.sample_rate) {
-        gb->apu_output.cycles_per_sample = 2 * GB_get_clock_rate(gb) / (double)gb->apu_output.sample_rate; /* 2 * because we use 8MHz units */
+        double cycles_per_sample = 2 * GB_get_clock_rate(gb) / (double)gb->apu_output.sample_rate; /* 2 * because we use 8MHz units */
+        gb->apu_output.cycles_per_sample = cycles_per_sample * 0x100000000;
+        /* APU ticks are 4 8MHz cycles */
+        gb->apu_output.blep_step = 4 / cycles_per_sample * 0x100000000;
     }
 }
@@ -30,18 +30,21 @@
 
 /* APU ticks are 2MHz, triggered by an internal APU clock. */
 
+/* Band limited resampling places every level change as a windowed sinc step spanning GB_BLEP_TAPS output samples */
+#define GB_BLEP_TAPS 16
+#define GB_BLEP_PHASES 64
+#define GB_BLEP_BUFFER_LENGTH 32 // Power of 2, at least GB_BLEP_TAPS plus the samples a single render can lag by
+
+/* Rendered samples are highpass filtered and written to the output buffer in blocks of this many samples. A multiple
+   of 4, as the highpass filter handles 4 samples at once. */
+#define GB_APU_BLOCK_LENGTH 32
+
 typedef struct
 {
     int16_t left;
     int16_t right;
 } GB_sample_t;
 
-typedef struct
-{
-    double left;
-    double right;
-} GB_double_sample_t;
-
 enum GB_CHANNELS {
     GB_SQUARE_1,
     GB_SQUARE_2,
@@ -128,36 +131,69 @@ typedef enum {
     GB_HIGHPASS_MAX
 } GB_highpass_mode_t;
 
+typedef enum {
+    GB_AUDIO_RESAMPLING_AVERAGE, // Average every channel over each output sample (Default)
+    GB_AUDIO_RESAMPLING_BAND_LIMITED, // Synthesize band limited steps, removes aliasing at the cost of GB_BLEP_TAPS / 2 samples of latency
+} GB_audio_resampling_mode_t;
+
 typedef struct {
     unsigned sample_rate;
 
+    /* A single-producer, single-consumer ring buffer. Positions are free running and only ever advanced by their
+       owner: write_position by the emulation thread, read_position by GB_apu_copy_buffer. */
     GB_sample_t *buffer;
-    size_t buffer_size;
-    size_t buffer_position;
+    size_t buffer_capacity; // Allocated samples, a power of 2
+    size_t buffer_size; // Most samples buffered at once, grown by GB_apu_copy_buffer on underflows
+    size_t read_position;
+    size_t write_position;
+    uint32_t last_sample; // The last sample written by the emulation thread, a GB_sample_t; fills underflows
 
     bool stream_started; /* detects first copy request to minimize lag */
-    volatile bool copy_in_progress;
-    volatile bool lock;
 
-    double sample_cycles; // In 8 MHz units
-    double cycles_per_sample;
+    /* Mixing is done entirely in fixed point. Compared to mixing in floating point, samples differ by at most 4 from
+       rounding. GB_HIGHPASS_ACCURATE doesn't truncate its output toward zero at every sample, so a decaying offset
+       follows the filter's curve instead of stepping down by 1 per sample once it's below 1 / (1 - rate). */
+    uint64_t sample_cycles; // In 8 MHz units, 32.32 fixed point
+    uint64_t cycles_per_sample; // 32.32 fixed point
 
     // Samples are NOT normalized to MAX_CH_AMP * 4 at this stage!
     unsigned cycles_since_render;
     unsigned last_update[GB_N_CHANNELS];
     GB_sample_t current_sample[GB_N_CHANNELS];
     GB_sample_t summed_samples[GB_N_CHANNELS];
-    double dac_discharge[GB_N_CHANNELS];
+    uint32_t dac_discharge[GB_N_CHANNELS]; // 16.16 fixed point
+    uint32_t dac_attack_step; // Per sample, 16.16 fixed point
+    uint32_t dac_decay_step;
 
     GB_highpass_mode_t highpass_mode;
-    double highpass_rate;
-    GB_double_sample_t highpass_diff;
+    int32_t highpass_rate[4]; // The rate raised to the powers of 1 to 4, 1.31 fixed point
+    int32_t highpass_diff[2]; // 17.15 fixed point
+
+    GB_sample_t block[GB_APU_BLOCK_LENGTH];
+    GB_sample_t block_dc_levels[GB_APU_BLOCK_LENGTH]; // The highpass filter's input in GB_HIGHPASS_REMOVE_DC_OFFSET
+    unsigned block_length;
+    GB_highpass_mode_t block_highpass_mode;
+
+    GB_audio_resampling_mode_t resampling_mode;
+    uint32_t dac_multiplier[GB_N_CHANNELS]; // The multiplier used by the last rendered sample, 16.16 fixed point
+    uint64_t blep_step; // Output samples per APU tick, 32.32 fixed point
+    uint64_t blep_phase; // Output samples since the last rendered sample was due, 32.32 fixed point
+    /* The derivative of the upcoming output, in 1.15 fixed point; integrating it gives the band limited signal */
+    int32_t blep_buffer[GB_BLEP_BUFFER_LENGTH][2];
+    unsigned blep_head;
+    int32_t blep_integrator[2];
+    int32_t blep_level[GB_N_CHANNELS][2];
 } GB_apu_output_t;
 
 void GB_set_sample_rate(GB_gameboy_t *gb, unsigned int sample_rate);
+/* GB_apu_copy_buffer and the buffer queries may be called from an audio thread while the emulation runs. Neither side
+   ever waits for the other: new samples are dropped while the buffer is full, and missing ones are filled in with the
+   last sample produced. The audio thread never touches the APU state itself. */
 void GB_apu_copy_buffer(GB_gameboy_t *gb, GB_sample_t *dest, size_t count);
 size_t GB_apu_get_current_buffer_length(GB_gameboy_t *gb);
+size_t GB_apu_get_buffer_size(GB_gameboy_t *gb); // Samples that can be buffered before new ones are dropped
 void GB_set_highpass_filter_mode(GB_gameboy_t *gb, GB_highpass_mode_t mode);
+void GB_set_audio_resampling_mode(GB_gameboy_t *gb, GB_audio_resampling_mode_t mode);
 
 #ifdef GB_INTERNAL
 bool GB_apu_is_DAC_enabled(GB_gameboy_t *gb, unsigned index);
@@ -167,6 +203,7 @@ void GB_apu_div_event(GB_gameboy_t *gb);
 void GB_apu_init(GB_gameboy_t *gb);
 void GB_apu_run(GB_gameboy_t *gb);
 void GB_apu_update_cycles_per_sample(GB_gameboy_t *gb);
+unsigned GB_apu_batchable_cycles(GB_gameboy_t *gb);
 #endif
 
 #endif /* apu_h */
@@ -52,6 +52,7 @@ struct GB_watchpoint_s {
     };
     char *condition;
     uint8_t flags;
+    uint16_t end; /* Last address covered, equals addr unless this is a range watchpoint */
 };
 
 #define WP_KEY(x) (((struct GB_watchpoint_s){.addr = ((x).value), .bank = (x).has_bank? (x).bank : -1 }).key)
@@ -105,6 +106,7 @@ static inline void restore_banking_state(GB_gameboy_t *gb, banking_state_t *stat
     gb->mbc_ram_enable = state->mbc_ram_enable;
     gb->cgb_ram_bank = state->ram_bank;
     gb->cgb_vram_bank = state->vram_bank;
+    GB_update_page_table(gb);
 }
 
 static inline void switch_banking_state(GB_gameboy_t *gb, uint16_t bank)
@@ -120,6 +122,7 @@ static inline void switch_banking_state(GB_gameboy_t *gb, uint16_t bank)
             gb->cgb_ram_bank = 1;
         }
     }
+    GB_update_page_table(gb);
 }
 
 static const char *value_to_string(GB_gameboy_t *gb, uint16_t value, bool prefer_name)
@@ -1011,6 +1014,24 @@ static uint16_t find_watchpoint(GB_gameboy_t *gb, value_t addr)
     return (uint16_t) min;
 }
 
+/* The bitmaps let the memory bus skip watchpoint lookups for addresses not covered by any watchpoint */
+static void update_watchpoint_bitmaps(GB_gameboy_t *gb)
+{
+    memset(gb->read_watchpoint_bitmap, 0, sizeof(gb->read_watchpoint_bitmap));
+    memset(gb->write_watchpoint_bitmap, 0, sizeof(gb->write_watchpoint_bitmap));
+    for (unsigned i = 0; i < gb->n_watchpoints; i++) {
+        unsigned addr = gb->watchpoints[i].addr;
+        do {
+            if (gb->watchpoints[i].flags & GB_WATCHPOINT_R) {
+                gb->read_watchpoint_bitmap[addr >> 3] |= 1 << (addr & 7);
+            }
+            if (gb->watchpoints[i].flags & GB_WATCHPOINT_W) {
+                gb->write_watchpoint_bitmap[addr >> 3] |= 1 << (addr & 7);
+            }
+        } while (addr++ < gb->watchpoints[i].end);
+    }
+}
+
 static bool watch(GB_gameboy_t *gb, char *arguments, char *modifiers, const debugger_command_t *command)
 {
     if (strlen(lstrip(arguments)) == 0) {
@@ -1061,12 +1082,28 @@ print_usage:
 
     }
 
+    char *range_end = NULL;
+    if ((range_end = strstr(arguments, " to "))) {
+        *range_end = 0;
+        range_end += strlen(" to ");
+    }
+
     bool error;
     value_t result = debugger_evaluate(gb, arguments, (unsigned int)strlen(arguments), &error, NULL, NULL);
     uint32_t key = WP_KEY(result);
 
     if (error) return true;
 
+    uint16_t end = result.value;
+    if (range_end) {
+        end = debugger_evaluate(gb, range_end, (unsigned int)strlen(range_end), &error, NULL, NULL).value;
+        if (error) return true;
+        if (end < result.value) {
+            GB_log(gb, "Watchpoint range ends before it starts\n");
+            return true;
+        }
+    }
+
     uint16_t index = find_watchpoint(gb, result);
     if (index < gb->n_watchpoints && gb->watchpoints[index].key == key) {
         GB_log(gb, "Watchpoint already set at %s\n", debugger_value_to_string(gb, result, true));
@@ -1074,6 +1111,10 @@ print_usage:
             GB_log(gb, "Modified watchpoint type\n");
             gb->watchpoints[index].flags = flags;
         }
+        if (gb->watchpoints[index].end != end) {
+            GB_log(gb, "Modified watchpoint range\n");
+            gb->watchpoints[index].end = end;
+        }
         if (!gb->watchpoints[index].condition && condition) {
             GB_log(gb, "Added condition to watchpoint\n");
             gb->watchpoints[index].condition = strdup(condition);
@@ -1088,6 +1129,7 @@ print_usage:
             free(gb->watchpoints[index].condition);
             gb->watchpoints[index].condition = NULL;
         }
+        update_watchpoint_bitmaps(gb);
         return true;
     }
 
@@ -1095,6 +1137,7 @@ print_usage:
     memmove(&gb->watchpoints[index + 1], &gb->watchpoints[index], (gb->n_watchpoints - index) * sizeof(gb->watchpoints[0]));
     gb->watchpoints[index].key = key;
     gb->watchpoints[index].flags = flags;
+    gb->watchpoints[index].end = end;
     if (condition) {
         gb->watchpoints[index].condition = strdup(condition);
     }
@@ -1102,8 +1145,14 @@ print_usage:
         gb->watchpoints[index].condition = NULL;
     }
     gb->n_watchpoints++;
+    update_watchpoint_bitmaps(gb);
 
-    GB_log(gb, "Watchpoint set at %s\n", debugger_value_to_string(gb, result, true));
+    if (end != result.value) {
+        GB_log(gb, "Watchpoint set at %s to $%04x\n", debugger_value_to_string(gb, result, true), end);
+    }
+    else {
+        GB_log(gb, "Watchpoint set at %s\n", debugger_value_to_string(gb, result, true));
+    }
     return true;
 }
 
@@ -1119,6 +1168,7 @@ static bool unwatch(GB_gameboy_t *gb, char *arguments, char *modifiers, const de
         free(gb->watchpoints);
         gb->watchpoints = NULL;
         gb->n_watchpoints = 0;
+        update_watchpoint_bitmaps(gb);
         return true;
     }
 
@@ -1156,6 +1206,7 @@ static bool unwatch(GB_gameboy_t *gb, char *arguments, char *modifiers, const de
     memmove(&gb->watchpoints[index], &gb->watchpoints[index + 1], (gb->n_watchpoints - index - 1) * sizeof(gb->watchpoints[0]));
     gb->n_watchpoints--;
     gb->watchpoints = realloc(gb->watchpoints, gb->n_watchpoints* sizeof(gb->watchpoints[0]));
+    update_watchpoint_bitmaps(gb);
 
     GB_log(gb, "Watchpoint removed from %s\n", debugger_value_to_string(gb, result, true));
     return true;
@@ -1197,16 +1248,20 @@ static bool list(GB_gameboy_t *gb, char *arguments, char *modifiers, const debug
         GB_log(gb, "%d watchpoint(s) set:\n", gb->n_watchpoints);
         for (uint16_t i = 0; i < gb->n_watchpoints; i++) {
             value_t addr = (value_t){gb->watchpoints[i].bank != (uint16_t)-1, gb->watchpoints[i].bank, gb->watchpoints[i].addr};
+            char range[sizeof(" to $ffff")] = "";
+            if (gb->watchpoints[i].end != gb->watchpoints[i].addr) {
+                sprintf(range, " to $%04x", gb->watchpoints[i].end);
+            }
             if (gb->watchpoints[i].condition) {
-                GB_log(gb, " %d. %s (%c%c, Condition: %s)\n", i + 1, debugger_value_to_string(gb, addr, addr.has_bank),
-                                                              (gb->watchpoints[i].flags & GB_WATCHPOINT_R)? 'r' : '-',
-                                                              (gb->watchpoints[i].flags & GB_WATCHPOINT_W)? 'w' : '-',
-                                                              gb->watchpoints[i].condition);
+                GB_log(gb, " %d. %s%s (%c%c, Condition: %s)\n", i + 1, debugger_value_to_string(gb, addr, addr.has_bank), range,
+                                                                (gb->watchpoints[i].flags & GB_WATCHPOINT_R)? 'r' : '-',
+                                                                (gb->watchpoints[i].flags & GB_WATCHPOINT_W)? 'w' : '-',
+                                                                gb->watchpoints[i].condition);
             }
             else {
-                GB_log(gb, " %d. %s (%c%c)\n", i + 1, debugger_value_to_string(gb,addr, addr.has_bank),
-                                               (gb->watchpoints[i].flags & GB_WATCHPOINT_R)? 'r' : '-',
-                                               (gb->watchpoints[i].flags & GB_WATCHPOINT_W)? 'w' : '-');
+                GB_log(gb, " %d. %s%s (%c%c)\n", i + 1, debugger_value_to_string(gb,addr, addr.has_bank), range,
+                                                 (gb->watchpoints[i].flags & GB_WATCHPOINT_R)? 'r' : '-',
+                                                 (gb->watchpoints[i].flags & GB_WATCHPOINT_W)? 'w' : '-');
             }
         }
     }
@@ -1476,8 +1531,9 @@ static bool ticks(GB_gameboy_t *gb, char *arguments, char *modifiers, const debu
         return true;
     }
 
-    GB_log(gb, "Ticks: %lu. (Resetting)\n", gb->debugger_ticks);
+    GB_log(gb, "Ticks: %lu (%lu in idle loops). (Resetting)\n", gb->debugger_ticks, gb->debugger_idle_loop_ticks);
     gb->debugger_ticks = 0;
+    gb->debugger_idle_loop_ticks = 0;
 
     return true;
 }
@@ -1752,7 +1808,7 @@ static const debugger_command_t commands[] = {
     {"backtrace", 2, backtrace, "Display the current call stack"},
     {"bt", 2, }, /* Alias */
     {"sld", 3, stack_leak_detection, "Like finish, but stops if a stack leak is detected (Experimental)"},
-    {"ticks", 2, ticks, "Display the number of CPU ticks since the last time 'ticks' was used"},
+    {"ticks", 2, ticks, "Display the number of CPU ticks since the last time 'ticks' was used, and how many of them were fast-forwarded in idle loops"},
     {"registers", 1, registers, "Print values of processor registers and other important registers"},
     {"cartridge", 2, mbc, "Displays information about the MBC and cartridge"},
     {"mbc", 3, }, /* Alias */
@@ -1768,11 +1824,12 @@ static const debugger_command_t commands[] = {
                                   "jumping to the target.",
                                   "<expression>[ if <condition expression>]", "(j)"},
     {"delete", 2, delete, "Delete a breakpoint by its address, or all breakpoints", "[<expression>]"},
-    {"watch", 1, watch, "Add a new watchpoint at the specified address/expression." HELP_NEWLINE
-                        "Can also modify the condition and type of existing watchpoints." HELP_NEWLINE
+    {"watch", 1, watch, "Add a new watchpoint at the specified address/expression, or on every address" HELP_NEWLINE
+                        "of an inclusive range." HELP_NEWLINE
+                        "Can also modify the condition, type and range of existing watchpoints." HELP_NEWLINE
                         "Default watchpoint type is write-only.",
-                        "<expression>[ if <condition expression>]", "(r|w|rw)"},
-    {"unwatch", 3, unwatch, "Delete a watchpoint by its address, or all watchpoints", "[<expression>]"},
+                        "<expression>[ to <end expression>][ if <condition expression>]", "(r|w|rw)"},
+    {"unwatch", 3, unwatch, "Delete a watchpoint by its (start) address, or all watchpoints", "[<expression>]"},
     {"list", 1, list, "List all set breakpoints and watchpoints"},
     {"print", 1, print, "Evaluate and print an expression" HELP_NEWLINE
                         "Use modifier to format as an address (a, default) or as a number in" HELP_NEWLINE
@@ -1914,21 +1971,24 @@ void GB_debugger_ret_hook(GB_gameboy_t *gb)
 
 static bool _GB_debugger_test_write_watchpoint(GB_gameboy_t *gb, value_t addr, uint8_t value)
 {
-    uint16_t index = find_watchpoint(gb, addr);
-    uint32_t key = WP_KEY(addr);
+    uint16_t bank = addr.has_bank? addr.bank : -1;
 
-    if (index < gb->n_watchpoints && gb->watchpoints[index].key == key) {
-        if (!(gb->watchpoints[index].flags & GB_WATCHPOINT_W)) {
-            return false;
+    for (unsigned i = 0; i < gb->n_watchpoints; i++) {
+        struct GB_watchpoint_s *watchpoint = &gb->watchpoints[i];
+        if (watchpoint->bank != bank || addr.value < watchpoint->addr || addr.value > watchpoint->end) {
+            continue;
+        }
+        if (!(watchpoint->flags & GB_WATCHPOINT_W)) {
+            continue;
         }
-        if (!gb->watchpoints[index].condition) {
+        if (!watchpoint->condition) {
             gb->debug_stopped = true;
             GB_log(gb, "Watchpoint: [%s] = $%02x\n", debugger_value_to_string(gb, addr, true), value);
             return true;
         }
         bool error;
-        bool condition = debugger_evaluate(gb, gb->watchpoints[index].condition,
-                                           (unsigned int)strlen(gb->watchpoints[index].condition), &error, &addr.value, &value).value;
+        bool condition = debugger_evaluate(gb, watchpoint->condition,
+                                           (unsigned int)strlen(watchpoint->condition), &error, &addr.value, &value).value;
         if (error) {
             /* Should never happen */
             GB_log(gb, "An internal error has occured\n");
@@ -1945,6 +2005,7 @@ static bool _GB_debugger_test_write_watchpoint(GB_gameboy_t *gb, value_t addr, u
 
 void GB_debugger_test_write_watchpoint(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
 {
+    if (!(gb->write_watchpoint_bitmap[addr >> 3] & (1 << (addr & 7)))) return;
     if (gb->debug_stopped) return;
 
     /* Try any-bank breakpoint */
@@ -1959,21 +2020,24 @@ void GB_debugger_test_write_watchpoint(GB_gameboy_t *gb, uint16_t addr, uint8_t
 
 static bool _GB_debugger_test_read_watchpoint(GB_gameboy_t *gb, value_t addr)
 {
-    uint16_t index = find_watchpoint(gb, addr);
-    uint32_t key = WP_KEY(addr);
+    uint16_t bank = addr.has_bank? addr.bank : -1;
 
-    if (index < gb->n_watchpoints && gb->watchpoints[index].key == key) {
-        if (!(gb->watchpoints[index].flags & GB_WATCHPOINT_R)) {
-            return false;
+    for (unsigned i = 0; i < gb->n_watchpoints; i++) {
+        struct GB_watchpoint_s *watchpoint = &gb->watchpoints[i];
+        if (watchpoint->bank != bank || addr.value < watchpoint->addr || addr.value > watchpoint->end) {
+            continue;
+        }
+        if (!(watchpoint->flags & GB_WATCHPOINT_R)) {
+            continue;
         }
-        if (!gb->watchpoints[index].condition) {
+        if (!watchpoint->condition) {
             gb->debug_stopped = true;
             GB_log(gb, "Watchpoint: [%s]\n", debugger_value_to_string(gb, addr, true));
             return true;
         }
         bool error;
-        bool condition = debugger_evaluate(gb, gb->watchpoints[index].condition,
-                                           (unsigned int)strlen(gb->watchpoints[index].condition), &error, &addr.value, NULL).value;
+        bool condition = debugger_evaluate(gb, watchpoint->condition,
+                                           (unsigned int)strlen(watchpoint->condition), &error, &addr.value, NULL).value;
         if (error) {
             /* Should never happen */
             GB_log(gb, "An internal error has occured\n");
@@ -1990,6 +2054,7 @@ static bool _GB_debugger_test_read_watchpoint(GB_gameboy_t *gb, value_t addr)
 
 void GB_debugger_test_read_watchpoint(GB_gameboy_t *gb, uint16_t addr)
 {
+    if (!(gb->read_watchpoint_bitmap[addr >> 3] & (1 << (addr & 7)))) return;
     if (gb->debug_stopped) return;
 
     /* Try any-bank breakpoint */
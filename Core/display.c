@@ -3,85 +3,152 @@
 #include <assert.h>
 #include <string.h>
 #include "gb.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /* FIFO functions */
 
-static inline unsigned fifo_size(GB_fifo_t *fifo)
+static inline uint8_t flip_bits(uint8_t byte)
 {
-    return (fifo->write_end - fifo->read_end) & (GB_FIFO_LENGTH - 1);
+    byte = (byte >> 4) | (byte << 4);
+    byte = ((byte >> 2) & 0x33) | ((byte & 0x33) << 2);
+    return ((byte >> 1) & 0x55) | ((byte & 0x55) << 1);
 }
 
-static void fifo_clear(GB_fifo_t *fifo)
+static void fifo_clear(GB_bg_fifo_t *fifo)
 {
-    fifo->read_end = fifo->write_end = 0;
+    fifo->lower = fifo->upper = 0;
+    fifo->size = 0;
 }
 
-static GB_fifo_item_t *fifo_pop(GB_fifo_t *fifo)
+static uint8_t fifo_pop(GB_bg_fifo_t *fifo)
 {
-    GB_fifo_item_t *ret = &fifo->fifo[fifo->read_end];
+    uint8_t ret = (fifo->lower >> 7) | ((fifo->upper >> 7) << 1);
+    fifo->lower <<= 1;
+    fifo->upper <<= 1;
+    if (fifo->size) {
+        fifo->size--;
+    }
+    return ret;
+}
+
+static void fifo_push_bg_row(GB_bg_fifo_t *fifo, uint8_t lower, uint8_t upper, uint8_t palette, bool bg_priority, bool flip_x)
+{
+    /* The FIFO is only pushed to when it's empty */
+    if (flip_x) {
+        lower = flip_bits(lower);
+        upper = flip_bits(upper);
+    }
+    fifo->lower = lower;
+    fifo->upper = upper;
+    fifo->size = 8;
+    fifo->palette = palette;
+    fifo->bg_priority = bg_priority;
+}
+
+static void oam_fifo_clear(GB_oam_fifo_t *fifo)
+{
+    fifo->lower = fifo->upper = 0;
+    fifo->bg_priority = 0;
+}
+
+static uint8_t oam_fifo_pop(GB_oam_fifo_t *fifo, uint8_t *palette, bool *bg_priority)
+{
+    uint8_t ret = (fifo->lower >> 7) | ((fifo->upper >> 7) << 1);
+    *palette = fifo->palette[fifo->read_end];
+    *bg_priority = fifo->bg_priority & 0x80;
+    fifo->lower <<= 1;
+    fifo->upper <<= 1;
+    fifo->bg_priority <<= 1;
     fifo->read_end++;
-    fifo->read_end &= (GB_FIFO_LENGTH - 1);
+    fifo->read_end &= 7;
     return ret;
 }
 
-static void fifo_push_bg_row(GB_fifo_t *fifo, uint8_t lower, uint8_t upper, uint8_t palette, bool bg_priority, bool flip_x)
+static void fifo_overlay_object_row(GB_oam_fifo_t *fifo, uint8_t lower, uint8_t upper, uint8_t palette, bool bg_priority, uint8_t priority, bool flip_x)
 {
-    if (!flip_x) {
-        UNROLL
-        for (unsigned i = 8; i--;) {
-            fifo->fifo[fifo->write_end] = (GB_fifo_item_t) {
-                (lower >> 7) | ((upper >> 7) << 1),
-                palette,
-                0,
-                bg_priority,
-            };
-            lower <<= 1;
-            upper <<= 1;
-            
-            fifo->write_end++;
-            fifo->write_end &= (GB_FIFO_LENGTH - 1);
-        }
+    if (flip_x) {
+        lower = flip_bits(lower);
+        upper = flip_bits(upper);
     }
-    else {
-        UNROLL
-        for (unsigned i = 8; i--;) {
-            fifo->fifo[fifo->write_end] = (GB_fifo_item_t) {
-                (lower & 1) | ((upper & 1) << 1),
-                palette,
-                0,
-                bg_priority,
-            };
-            lower >>= 1;
-            upper >>= 1;
-            
-            fifo->write_end++;
-            fifo->write_end &= (GB_FIFO_LENGTH - 1);
+    
+    uint8_t opaque = lower | upper;
+    uint8_t occupied = fifo->lower | fifo->upper;
+    uint8_t mask = opaque & ~occupied;
+    
+    /* Opaque pixels are only replaced by objects with a lower OAM index, which only happens on the CGB */
+    for (uint8_t overlap = opaque & occupied; overlap; overlap &= overlap - 1) {
+        unsigned bit = __builtin_ctz(overlap);
+        if (fifo->priority[(fifo->read_end + 7 - bit) & 7] > priority) {
+            mask |= 1 << bit;
         }
     }
+    
+    fifo->lower = (fifo->lower & ~mask) | (lower & mask);
+    fifo->upper = (fifo->upper & ~mask) | (upper & mask);
+    fifo->bg_priority = (fifo->bg_priority & ~mask) | (bg_priority? mask : 0);
+    for (; mask; mask &= mask - 1) {
+        unsigned index = (fifo->read_end + 7 - __builtin_ctz(mask)) & 7;
+        fifo->palette[index] = palette;
+        fifo->priority[index] = priority;
+    }
 }
 
-static void fifo_overlay_object_row(GB_fifo_t *fifo, uint8_t lower, uint8_t upper, uint8_t palette, bool bg_priority, uint8_t priority, bool flip_x)
+
+/* Tile decoding */
+
+/* Decodes rows of 2bpp tile data, stored as in VRAM as a low and a high byte per row, into one color (0-3) per
+   pixel. Each row is 8 pixels, left to right unless flip_x is set. */
+static void decode_tile_rows(const uint8_t *data, uint8_t *pixels, unsigned rows, bool flip_x)
 {
-    while (fifo_size(fifo) < 8) {
-        fifo->fifo[fifo->write_end] = (GB_fifo_item_t) {0,};
-        fifo->write_end++;
-        fifo->write_end &= (GB_FIFO_LENGTH - 1);
+#ifdef __SSE2__
+    /* Each byte of the planes is spread over the 8 pixels of its row, and tested against that pixel's bit */
+    const __m128i bits = flip_x? _mm_set_epi8(0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1, 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1) :
+                                 _mm_set_epi8(1, 2, 4, 8, 0x10, 0x20, 0x40, 0x80, 1, 2, 4, 8, 0x10, 0x20, 0x40, 0x80);
+    const __m128i low_byte = _mm_set1_epi16(0xFF);
+    for (; rows >= 8; rows -= 8, data += 16, pixels += 64) {
+        __m128i planes = _mm_loadu_si128((const __m128i *)data);
+        __m128i lower = _mm_packus_epi16(_mm_and_si128(planes, low_byte), planes);
+        __m128i upper = _mm_packus_epi16(_mm_srli_epi16(planes, 8), planes);
+        lower = _mm_unpacklo_epi8(lower, lower);
+        upper = _mm_unpacklo_epi8(upper, upper);
+        __m128i lower_rows[2] = {_mm_unpacklo_epi16(lower, lower), _mm_unpackhi_epi16(lower, lower)};
+        __m128i upper_rows[2] = {_mm_unpacklo_epi16(upper, upper), _mm_unpackhi_epi16(upper, upper)};
+        UNROLL
+        for (unsigned i = 0; i < 4; i++) {
+            __m128i lower_pair = (i & 1)? _mm_unpackhi_epi32(lower_rows[i / 2], lower_rows[i / 2]) :
+                                          _mm_unpacklo_epi32(lower_rows[i / 2], lower_rows[i / 2]);
+            __m128i upper_pair = (i & 1)? _mm_unpackhi_epi32(upper_rows[i / 2], upper_rows[i / 2]) :
+                                          _mm_unpacklo_epi32(upper_rows[i / 2], upper_rows[i / 2]);
+            lower_pair = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lower_pair, bits), bits), _mm_set1_epi8(1));
+            upper_pair = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(upper_pair, bits), bits), _mm_set1_epi8(2));
+            _mm_storeu_si128((__m128i *)(pixels + i * 16), _mm_or_si128(lower_pair, upper_pair));
+        }
     }
-    
-    uint8_t flip_xor = flip_x? 0: 0x7;
-    
-    UNROLL
-    for (unsigned i = 8; i--;) {
-        uint8_t pixel = (lower >> 7) | ((upper >> 7) << 1);
-        GB_fifo_item_t *target = &fifo->fifo[(fifo->read_end + (i ^ flip_xor)) & (GB_FIFO_LENGTH - 1)];
-        if (pixel != 0 && (target->pixel == 0 || target->priority > priority)) {
-            target->pixel = pixel;
-            target->palette = palette;
-            target->bg_priority = bg_priority;
-            target->priority = priority;
-        }
-        lower <<= 1;
-        upper <<= 1;
+#elif defined(__ARM_NEON)
+    static const uint8_t bit_order[2][16] = {
+        {0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1, 0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1},
+        {1, 2, 4, 8, 0x10, 0x20, 0x40, 0x80, 1, 2, 4, 8, 0x10, 0x20, 0x40, 0x80},
+    };
+    const uint8x16_t bits = vld1q_u8(bit_order[flip_x]);
+    for (; rows >= 2; rows -= 2, data += 4, pixels += 16) {
+        uint8x16_t lower = vcombine_u8(vdup_n_u8(data[0]), vdup_n_u8(data[2]));
+        uint8x16_t upper = vcombine_u8(vdup_n_u8(data[1]), vdup_n_u8(data[3]));
+        vst1q_u8(pixels, vorrq_u8(vandq_u8(vtstq_u8(lower, bits), vdupq_n_u8(1)),
+                                  vandq_u8(vtstq_u8(upper, bits), vdupq_n_u8(2))));
+    }
+#endif
+    for (; rows; rows--, data += 2, pixels += 8) {
+        uint8_t lower = data[0];
+        uint8_t upper = data[1];
+        uint8_t flip_xor = flip_x? 0 : 0x7;
+        UNROLL
+        for (unsigned i = 0; i < 8; i++) {
+            pixels[i ^ flip_xor] = ((lower >> i) & 1) | (((upper >> i) & 1) << 1);
+        }
     }
 }
 
@@ -119,6 +186,117 @@ static bool window_enabled(GB_gameboy_t *gb)
     return (gb->io_registers[GB_IO_LCDC] & 0x20) && gb->io_registers[GB_IO_WX] < 167;
 }
 
+typedef struct GB_indexed_palettes_s {
+    uint32_t colors[LINES][GB_INDEXED_COLORS]; // The distinct palettes used this frame, in order
+    uint8_t palette_for_line[LINES];
+    uint8_t count;
+    bool blank_colors_valid; // Cleared whenever the palettes or the encode callback change
+    uint32_t white, black;
+} GB_indexed_palettes_t;
+
+/* Called before a line is drawn, adds the current colors to the frame's palettes if they changed */
+static void update_indexed_palette(GB_gameboy_t *gb, uint8_t line)
+{
+    GB_indexed_palettes_t *palettes = gb->indexed_palettes;
+    if (!palettes->blank_colors_valid) {
+        palettes->white = gb->rgb_encode_callback? gb->rgb_encode_callback(gb, 0xFF, 0xFF, 0xFF) : 0;
+        palettes->black = gb->rgb_encode_callback? gb->rgb_encode_callback(gb, 0, 0, 0) : 0;
+        palettes->blank_colors_valid = true;
+    }
+    uint32_t colors[GB_INDEXED_COLORS];
+    memcpy(colors + GB_INDEXED_BACKGROUND, gb->background_palettes_rgb, sizeof(gb->background_palettes_rgb));
+    memcpy(colors + GB_INDEXED_OBJECT, gb->sprite_palettes_rgb, sizeof(gb->sprite_palettes_rgb));
+    colors[GB_INDEXED_WHITE] = palettes->white;
+    colors[GB_INDEXED_BLACK] = palettes->black;
+    if (!palettes->count || memcmp(palettes->colors[palettes->count - 1], colors, sizeof(colors))) {
+        if (palettes->count == LINES) {
+            /* Only reachable if the frame was never restarted, reuse the last slot rather than overflowing */
+            palettes->count--;
+        }
+        memcpy(palettes->colors[palettes->count++], colors, sizeof(colors));
+    }
+    palettes->palette_for_line[line] = palettes->count - 1;
+}
+
+void GB_set_indexed_pixels_output(GB_gameboy_t *gb, uint8_t *output)
+{
+    if (output && !gb->indexed_palettes) {
+        gb->indexed_palettes = calloc(1, sizeof(*gb->indexed_palettes));
+    }
+    gb->indexed_screen = output;
+}
+
+const uint32_t *GB_get_indexed_palette(GB_gameboy_t *gb, unsigned line)
+{
+    if (!gb->indexed_palettes || line >= LINES) return NULL;
+    GB_indexed_palettes_t *palettes = gb->indexed_palettes;
+    if (!palettes->count) {
+        /* Nothing was drawn yet */
+        update_indexed_palette(gb, 0);
+    }
+    return palettes->colors[palettes->palette_for_line[line]];
+}
+
+void GB_expand_indexed_pixels(GB_gameboy_t *gb, const uint8_t *input, uint32_t *output)
+{
+    for (unsigned y = 0; y < LINES; y++) {
+        const uint32_t *colors = GB_get_indexed_palette(gb, y);
+        for (unsigned x = 0; x < WIDTH; x++) {
+            *(output++) = colors[*(input++)];
+        }
+    }
+}
+
+static uint64_t hash_line(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+/* Called after a line is drawn */
+static void update_line_hash(GB_gameboy_t *gb, uint8_t line)
+{
+    uint64_t hash = 0;
+    if (gb->indexed_screen) {
+        hash = hash_line(hash, gb->indexed_screen + line * WIDTH, WIDTH);
+        hash = hash_line(hash, GB_get_indexed_palette(gb, line), GB_INDEXED_COLORS * sizeof(uint32_t));
+    }
+    else if (gb->screen) {
+        hash = hash_line(hash, gb->screen + line * WIDTH, WIDTH * sizeof(uint32_t));
+    }
+    gb->line_hashes[line] = hash;
+}
+
+static void set_all_lines_dirty(uint32_t *dirty, unsigned lines)
+{
+    memset(dirty, 0, GB_DIRTY_LINES_WORDS * sizeof(uint32_t));
+    for (unsigned i = 0; i < lines; i++) {
+        dirty[i / 32] |= 1u << (i % 32);
+    }
+}
+
+bool GB_get_dirty_lines(GB_gameboy_t *gb, uint32_t dirty[GB_DIRTY_LINES_WORDS])
+{
+    if (!gb->dirty_lines_tracking) {
+        gb->dirty_lines_tracking = true;
+        set_all_lines_dirty(dirty, GB_get_screen_height(gb));
+        return true;
+    }
+    
+    bool ret = false;
+    for (unsigned i = 0; i < GB_DIRTY_LINES_WORDS; i++) {
+        dirty[i] = gb->dirty_lines[i];
+        ret |= dirty[i] != 0;
+    }
+    return ret;
+}
+
 static void display_vblank(GB_gameboy_t *gb)
 {  
     gb->vblank_just_occured = true;
@@ -142,6 +320,15 @@ static void display_vblank(GB_gameboy_t *gb)
                 gb->sgb->screen_buffer[i] = color;
             }
         }
+        else if (gb->indexed_screen) {
+            memset(gb->indexed_screen,
+                   (gb->io_registers[GB_IO_LCDC] & 0x80) && gb->stopped ? GB_INDEXED_BLACK : GB_INDEXED_WHITE,
+                   WIDTH * LINES);
+            /* Any line's palette has the blank colors, make sure all lines have one */
+            gb->indexed_palettes->count = 0;
+            update_indexed_palette(gb, 0);
+            memset(gb->indexed_palettes->palette_for_line, 0, LINES);
+        }
         else {
             uint32_t color = (gb->io_registers[GB_IO_LCDC] & 0x80)  && gb->stopped ?
                                 gb->rgb_encode_callback(gb, 0, 0, 0) :
@@ -150,6 +337,27 @@ static void display_vblank(GB_gameboy_t *gb)
                 gb ->screen[i] = color;
             }
         }
+        if (gb->dirty_lines_tracking && !gb->sgb) {
+            for (unsigned i = 0; i < LINES; i++) {
+                update_line_hash(gb, i);
+            }
+        }
+    }
+    
+    if (gb->dirty_lines_tracking) {
+        if (gb->sgb) {
+            set_all_lines_dirty(gb->dirty_lines, GB_get_screen_height(gb));
+        }
+        else {
+            /* A line might be drawn several times between two frames, only its last contents are presented */
+            memset(gb->dirty_lines, 0, sizeof(gb->dirty_lines));
+            for (unsigned i = 0; i < LINES; i++) {
+                if (gb->line_hashes[i] != gb->presented_line_hashes[i]) {
+                    gb->dirty_lines[i / 32] |= 1u << (i % 32);
+                }
+            }
+            memcpy(gb->presented_line_hashes, gb->line_hashes, sizeof(gb->line_hashes));
+        }
     }
 
     gb->vblank_callback(gb);
@@ -166,13 +374,13 @@ static inline uint8_t scale_channel_with_curve(uint8_t x)
     return (uint8_t[]){0,2,4,7,12,18,25,34,42,52,62,73,85,97,109,121,134,146,158,170,182,193,203,213,221,230,237,243,248,251,253,255,}[x];
 }
 
-uint32_t GB_convert_rgb15(GB_gameboy_t *gb, uint16_t color)
+static uint32_t convert_rgb15(GB_gameboy_t *gb, uint16_t color, GB_color_correction_mode_t mode, GB_rgb_encode_callback_t callback)
 {
     uint8_t r = (color) & 0x1F;
     uint8_t g = (color >> 5) & 0x1F;
     uint8_t b = (color >> 10) & 0x1F;
     
-    if (gb->color_correction_mode == GB_COLOR_CORRECTION_DISABLED) {
+    if (mode == GB_COLOR_CORRECTION_DISABLED) {
         r = scale_channel(r);
         g = scale_channel(g);
         b = scale_channel(b);
@@ -182,10 +390,10 @@ uint32_t GB_convert_rgb15(GB_gameboy_t *gb, uint16_t color)
         g = scale_channel_with_curve(g);
         b = scale_channel_with_curve(b);
         
-        if (gb->color_correction_mode != GB_COLOR_CORRECTION_CORRECT_CURVES) {
+        if (mode != GB_COLOR_CORRECTION_CORRECT_CURVES) {
             uint8_t new_g = (g * 3 + b) / 4;
             uint8_t new_r = r, new_b = b;
-            if (gb->color_correction_mode == GB_COLOR_CORRECTION_PRESERVE_BRIGHTNESS) {
+            if (mode == GB_COLOR_CORRECTION_PRESERVE_BRIGHTNESS) {
                 uint8_t old_max = MAX(r, MAX(g, b));
                 uint8_t new_max = MAX(new_r, MAX(new_g, new_b));
                 
@@ -210,16 +418,103 @@ uint32_t GB_convert_rgb15(GB_gameboy_t *gb, uint16_t color)
         }
     }
     
-    return gb->rgb_encode_callback(gb, r, g, b);
+    return callback(gb, r, g, b);
+}
+
+struct GB_color_table_s {
+    GB_color_correction_mode_t mode;
+    GB_rgb_encode_callback_t callback;
+    unsigned reference_count;
+    uint32_t converted[0x8000 / 32]; // One bit per color, set once it's in colors
+    uint32_t colors[0x8000];
+};
+
+GB_color_table_t *GB_color_table_create(GB_color_correction_mode_t mode, GB_rgb_encode_callback_t callback)
+{
+    if (!callback) return NULL;
+    GB_color_table_t *table = calloc(1, sizeof(*table));
+    table->mode = mode;
+    table->callback = callback;
+    table->reference_count = 1;
+    return table;
+}
+
+GB_color_table_t *GB_color_table_retain(GB_color_table_t *table)
+{
+    __atomic_add_fetch(&table->reference_count, 1, __ATOMIC_RELAXED);
+    return table;
+}
+
+void GB_color_table_release(GB_color_table_t *table)
+{
+    if (__atomic_sub_fetch(&table->reference_count, 1, __ATOMIC_ACQ_REL)) return;
+    free(table);
+}
+
+void GB_set_color_table(GB_gameboy_t *gb, GB_color_table_t *table)
+{
+    if (!table || !table->callback) {
+        GB_log(gb, "Color tables must be created with an RGB encode callback\n");
+        return;
+    }
+    /* The table is installed before converting the palettes, so they're converted into it rather than into a
+       private table */
+    GB_color_table_retain(table);
+    if (gb->color_table) {
+        GB_color_table_release(gb->color_table);
+    }
+    GB_set_initial_dmg_colors(gb, table->callback);
+    gb->color_correction_mode = table->mode;
+    gb->rgb_encode_callback = table->callback;
+    gb->color_table = table;
+    for (unsigned i = 0; i < 32; i++) {
+        GB_palette_changed(gb, true, i * 2);
+        GB_palette_changed(gb, false, i * 2);
+    }
+}
+
+uint32_t GB_convert_rgb15(GB_gameboy_t *gb, uint16_t color)
+{
+    GB_color_table_t *table = gb->color_table;
+    if (!table || table->mode != gb->color_correction_mode || table->callback != gb->rgb_encode_callback) {
+        if (table) {
+            GB_color_table_release(table);
+        }
+        table = gb->color_table = GB_color_table_create(gb->color_correction_mode, gb->rgb_encode_callback);
+    }
+    
+    /* Several instances on different threads might convert the same color, they all store the same value */
+    color &= 0x7FFF;
+    uint32_t bit = 1u << (color & 31);
+    if (__atomic_load_n(&table->converted[color / 32], __ATOMIC_ACQUIRE) & bit) {
+        return __atomic_load_n(&table->colors[color], __ATOMIC_RELAXED);
+    }
+    uint32_t ret = convert_rgb15(gb, color, table->mode, table->callback);
+    __atomic_store_n(&table->colors[color], ret, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&table->converted[color / 32], bit, __ATOMIC_RELEASE);
+    return ret;
 }
 
 void GB_palette_changed(GB_gameboy_t *gb, bool background_palette, uint8_t index)
 {
-    if (!gb->rgb_encode_callback || !GB_is_cgb(gb)) return;
+    gb->scanline_rendered = false;
+    if (gb->indexed_palettes) {
+        gb->indexed_palettes->blank_colors_valid = false;
+    }
+    if (!gb->rgb_encode_callback || !GB_is_cgb(gb)) {
+        /* The DMG colors are set directly by the caller */
+        gb->palette_generation++;
+        return;
+    }
     uint8_t *palette_data = background_palette? gb->background_palettes_data : gb->sprite_palettes_data;
     uint16_t color = palette_data[index & ~1] | (palette_data[index | 1] << 8);
 
-    (background_palette? gb->background_palettes_rgb : gb->sprite_palettes_rgb)[index / 2] = GB_convert_rgb15(gb, color);
+    uint32_t *rgb = &(background_palette? gb->background_palettes_rgb : gb->sprite_palettes_rgb)[index / 2];
+    uint32_t converted = GB_convert_rgb15(gb, color);
+    if (*rgb != converted) {
+        *rgb = converted;
+        gb->palette_generation++;
+    }
 }
 
 void GB_set_color_correction_mode(GB_gameboy_t *gb, GB_color_correction_mode_t mode)
@@ -279,10 +574,23 @@ void GB_STAT_update(GB_gameboy_t *gb)
     }
 }
 
+/* How many 8MHz cycles the display can run for without requesting an enabled interrupt, starting HBlank DMA or
+   reaching VBlank. While no STAT interrupt can fire, that's at least until the last visible line. */
+unsigned GB_display_uneventful_cycles(GB_gameboy_t *gb)
+{
+    if (gb->display_cycles > 0) return 0;
+    unsigned cycles = -gb->display_cycles;
+    
+    if (!(gb->io_registers[GB_IO_LCDC] & 0x80) || gb->hdma_on_hblank || gb->current_line >= LINES) return cycles;
+    if ((gb->interrupt_enable & 2) && (gb->io_registers[GB_IO_STAT] & 0x78)) return cycles;
+    return MAX(cycles, (LINES - 1 - gb->current_line) * LINE_LENGTH * 2);
+}
+
 void GB_lcd_off(GB_gameboy_t *gb)
 {
     gb->display_state = 0;
     gb->display_cycles = 0;
+    gb->mode_3_timing_only = false;
     /* When the LCD is disabled, state is constant */
     
     /* When the LCD is off, LY is 0 and STAT mode is 0.  */
@@ -311,6 +619,40 @@ void GB_lcd_off(GB_gameboy_t *gb)
     gb->accessed_oam_row = -1;
 }
 
+/* Adds or removes an object from the lines its Y position covers in objects_on_line */
+static void index_object_lines(GB_gameboy_t *gb, unsigned index, uint8_t y, bool present)
+{
+    uint64_t bit = 1ULL << index;
+    signed top = y - 16;
+    for (signed line = MAX(top, 0); line < top + 16 && line < LINES; line++) {
+        for (unsigned height_16 = line - top >= 8; height_16 < 2; height_16++) {
+            if (present) {
+                gb->objects_on_line[height_16][line] |= bit;
+            }
+            else {
+                gb->objects_on_line[height_16][line] &= ~bit;
+            }
+        }
+    }
+}
+
+void GB_display_update_object_index(GB_gameboy_t *gb, unsigned first, unsigned count)
+{
+    const GB_object_t *objects = (const GB_object_t *) &gb->oam;
+    for (unsigned i = first; i < first + count && i < 40; i++) {
+        uint8_t y = objects[i].y;
+        if (y == gb->indexed_object_y[i]) continue;
+        index_object_lines(gb, i, gb->indexed_object_y[i], false);
+        index_object_lines(gb, i, y, true);
+        gb->indexed_object_y[i] = y;
+    }
+}
+
+static inline uint64_t objects_on_current_line(GB_gameboy_t *gb)
+{
+    return gb->objects_on_line[(gb->io_registers[GB_IO_LCDC] & 4) != 0][gb->current_line];
+}
+
 static void add_object_from_index(GB_gameboy_t *gb, unsigned index)
 {
     if (gb->n_visible_objs == 10) return;
@@ -321,10 +663,8 @@ static void add_object_from_index(GB_gameboy_t *gb, unsigned index)
     }
 
     /* This reverse sorts the visible objects by location and priority */
-    GB_object_t *objects = (GB_object_t *) &gb->oam;
-    bool height_16 = (gb->io_registers[GB_IO_LCDC] & 4) != 0;
-    signed y = objects[index].y - 16;
-    if (y <= gb->current_line && y + (height_16? 16 : 8) > gb->current_line) {
+    if (objects_on_current_line(gb) & (1ULL << index)) {
+        GB_object_t *objects = (GB_object_t *) &gb->oam;
         unsigned j = 0;
         for (; j < gb->n_visible_objs; j++) {
             if (gb->obj_comparators[j] <= objects[index].x) break;
@@ -339,22 +679,22 @@ static void add_object_from_index(GB_gameboy_t *gb, unsigned index)
 
 static void render_pixel_if_possible(GB_gameboy_t *gb)
 {
-    GB_fifo_item_t *fifo_item = NULL;
-    GB_fifo_item_t *oam_fifo_item = NULL;
+    uint8_t bg_pixel = 0, oam_pixel = 0, oam_palette = 0;
     bool draw_oam = false;
     bool bg_enabled = true, bg_priority = false;
     
     if (!gb->bg_fifo_paused) {
-        fifo_item = fifo_pop(&gb->bg_fifo);
-        bg_priority = fifo_item->bg_priority;
+        bg_pixel = fifo_pop(&gb->bg_fifo);
+        bg_priority = gb->bg_fifo.bg_priority;
     }
     
-    if (!gb->oam_fifo_paused && fifo_size(&gb->oam_fifo)) {
-        oam_fifo_item = fifo_pop(&gb->oam_fifo);
+    if (!gb->oam_fifo_paused) {
+        bool oam_bg_priority;
+        oam_pixel = oam_fifo_pop(&gb->oam_fifo, &oam_palette, &oam_bg_priority);
         /* Todo: Verify access timings */
-        if (oam_fifo_item->pixel && (gb->io_registers[GB_IO_LCDC] & 2)) {
+        if (oam_pixel && (gb->io_registers[GB_IO_LCDC] & 2)) {
             draw_oam = true;
-            bg_priority |= oam_fifo_item->bg_priority;
+            bg_priority |= oam_bg_priority;
         }
     }
     
@@ -364,6 +704,10 @@ static void render_pixel_if_possible(GB_gameboy_t *gb)
         return;
     }
     if (gb->bg_fifo_paused) return;
+    if (gb->scanline_rendered) {
+        gb->position_in_line++;
+        return;
+    }
     
     /* Mixing */
     
@@ -381,7 +725,7 @@ static void render_pixel_if_possible(GB_gameboy_t *gb)
     }
     
     {
-        uint8_t pixel = bg_enabled? fifo_item->pixel : 0;
+        uint8_t pixel = bg_enabled? bg_pixel : 0;
         if (pixel && bg_priority) {
             draw_oam = false;
         }
@@ -393,27 +737,33 @@ static void render_pixel_if_possible(GB_gameboy_t *gb)
                 gb->sgb->screen_buffer[gb->position_in_line + gb->current_lcd_line * WIDTH] = pixel;
             }
         }
+        else if (gb->indexed_screen) {
+            gb->indexed_screen[gb->position_in_line + gb->current_line * WIDTH] = GB_INDEXED_BACKGROUND + gb->bg_fifo.palette * 4 + pixel;
+        }
         else {
-            gb->screen[gb->position_in_line + gb->current_line * WIDTH] = gb->background_palettes_rgb[fifo_item->palette * 4 + pixel];
+            gb->screen[gb->position_in_line + gb->current_line * WIDTH] = gb->background_palettes_rgb[gb->bg_fifo.palette * 4 + pixel];
         }
         if (gb->bg_screen) {
-            gb->bg_screen[gb->position_in_line + gb->current_line * WIDTH] = gb->background_palettes_rgb[fifo_item->palette * 4 + pixel];
+            gb->bg_screen[gb->position_in_line + gb->current_line * WIDTH] = gb->background_palettes_rgb[gb->bg_fifo.palette * 4 + pixel];
         }
     }
     
     if (draw_oam) {
-        uint8_t pixel = oam_fifo_item->pixel;
+        uint8_t pixel = oam_pixel;
         if (!gb->cgb_mode) {
             /* Todo: Verify access timings */
-            pixel = ((gb->io_registers[oam_fifo_item->palette? GB_IO_OBP1 : GB_IO_OBP0] >> (pixel << 1)) & 3);
+            pixel = ((gb->io_registers[oam_palette? GB_IO_OBP1 : GB_IO_OBP0] >> (pixel << 1)) & 3);
         }
         if (gb->sgb) {
             if (gb->current_lcd_line < LINES) {
                 gb->sgb->screen_buffer[gb->position_in_line + gb->current_lcd_line * WIDTH] = pixel;
             }
         }
+        else if (gb->indexed_screen) {
+            gb->indexed_screen[gb->position_in_line + gb->current_line * WIDTH] = GB_INDEXED_OBJECT + oam_palette * 4 + pixel;
+        }
         else {
-            gb->screen[gb->position_in_line + gb->current_line * WIDTH] = gb->sprite_palettes_rgb[oam_fifo_item->palette * 4 + pixel];
+            gb->screen[gb->position_in_line + gb->current_line * WIDTH] = gb->sprite_palettes_rgb[oam_palette * 4 + pixel];
         }
     }
     
@@ -533,7 +883,7 @@ static void advance_fetcher_state_machine(GB_gameboy_t *gb)
         break;
             
         case GB_FETCHER_PUSH: {
-            if (fifo_size(&gb->bg_fifo) > 0) break;
+            if (gb->bg_fifo.size > 0) break;
             fifo_push_bg_row(&gb->bg_fifo, gb->current_tile_data[0], gb->current_tile_data[1],
                              gb->current_tile_attributes & 7, gb->current_tile_attributes & 0x80, gb->current_tile_attributes & 0x20);
             gb->bg_fifo_paused = false;
@@ -552,6 +902,494 @@ static void advance_fetcher_state_machine(GB_gameboy_t *gb)
     gb->fetcher_state &= 7;
 }
 
+/* Fetches a row of a background or window tile for render_scanline, flipped horizontally if needed */
+static void fetch_scanline_tile(GB_gameboy_t *gb, uint8_t *row, uint8_t *attributes, uint16_t map, uint8_t x, uint8_t y, bool is_cgb)
+{
+    const uint8_t *vram = gb->vram;
+    uint8_t tile = vram[map + x + y / 8 * 32];
+    uint8_t tile_attributes = 0;
+    if (is_cgb) {
+        tile_attributes = vram[map + x + y / 8 * 32 + 0x2000];
+    }
+
+    uint16_t tile_address = 0;
+    if (gb->io_registers[GB_IO_LCDC] & 0x10) {
+        tile_address = tile * 0x10;
+    }
+    else {
+        tile_address = (int8_t)tile * 0x10 + 0x1000;
+    }
+    if (tile_attributes & 8) {
+        tile_address += 0x2000;
+    }
+    uint8_t y_flip = (tile_attributes & 0x40)? 0x7 : 0;
+    row[0] = vram[tile_address + ((y & 7) ^ y_flip) * 2];
+    row[1] = vram[tile_address + ((y & 7) ^ y_flip) * 2 + 1];
+    if (tile_attributes & 0x20) {
+        row[0] = flip_bits(row[0]);
+        row[1] = flip_bits(row[1]);
+    }
+    memset(attributes, tile_attributes, 8);
+}
+
+/* Everything render_scanline's output depends on besides the line number. VRAM is represented by the generations of
+   the regions the line reads, and the objects on the line by copies of their OAM entries. Unused fields are zero, so
+   signatures can be compared with memcmp. */
+typedef struct {
+    uint32_t tile_data_generation;
+    uint32_t palette_generation; // Only if host colors are output
+    uint32_t map_row_generations[2]; // Background, window
+    GB_object_t objects[10];
+    uint8_t object_indices[10];
+    uint8_t n_objects;
+    uint8_t lcdc, scx, scy, bgp, obp0, obp1;
+    uint8_t window_start, window_y;
+    uint8_t output;
+    bool cgb_mode;
+} line_signature_t;
+
+enum {
+    LINE_OUTPUT_SCREEN = 1,
+    LINE_OUTPUT_INDEXED = 2,
+    LINE_OUTPUT_SGB = 4,
+    LINE_OUTPUT_BG_SCREEN = 8,
+};
+
+typedef struct {
+    line_signature_t signature;
+    bool valid;
+    uint32_t pixels[WIDTH]; // Host colors, or a byte per pixel for indexed and Super Game Boy output
+    uint32_t bg_pixels[WIDTH];
+} cached_line_t;
+
+struct GB_line_cache_s {
+    cached_line_t lines[LINES];
+};
+
+void GB_display_invalidate_line_cache(GB_gameboy_t *gb)
+{
+    if (!gb->line_cache) return;
+    for (unsigned i = 0; i < LINES; i++) {
+        gb->line_cache->lines[i].valid = false;
+    }
+}
+
+void GB_set_line_cache_enabled(GB_gameboy_t *gb, bool enabled)
+{
+    if (enabled == !!gb->line_cache) return;
+    if (enabled) {
+        gb->line_cache = calloc(1, sizeof(*gb->line_cache));
+    }
+    else {
+        free(gb->line_cache);
+        gb->line_cache = NULL;
+    }
+}
+
+/* Draws the entire current line from VRAM and OAM at the start of mode 3. The result is identical to the FIFO's
+   output as long as nothing the PPU reads is modified during mode 3; such modifications clear scanline_rendered,
+   and render_pixel_if_possible draws the rest of the line from that point. Returns false if the line was left to
+   the FIFO. */
+static bool render_scanline(GB_gameboy_t *gb)
+{
+    if (gb->disable_rendering) return false;
+    /* The frontend did not see the last frame yet, don't draw pixels of the next one ahead of time */
+    if (gb->vblank_just_occured) return false;
+
+    uint8_t lcdc = gb->io_registers[GB_IO_LCDC];
+    bool is_cgb = GB_is_cgb(gb);
+    bool cgb_mode = gb->cgb_mode;
+    unsigned window_start = WIDTH;
+    if (window_enabled(gb) && gb->current_line >= gb->io_registers[GB_IO_WY] + gb->wy_diff) {
+        /* The window starts at a glitched position when WX < 7, leave these lines to the FIFO */
+        if (gb->io_registers[GB_IO_WX] < 7) return false;
+        window_start = gb->io_registers[GB_IO_WX] - 7;
+    }
+
+    uint32_t *screen = NULL;
+    uint32_t *bg_screen = NULL;
+    uint8_t *sgb_screen = NULL;
+    uint8_t *indexed_screen = NULL;
+    if (gb->sgb) {
+        if (gb->current_lcd_line < LINES) {
+            sgb_screen = gb->sgb->screen_buffer + gb->current_lcd_line * WIDTH;
+        }
+    }
+    else if (gb->indexed_screen) {
+        indexed_screen = gb->indexed_screen + gb->current_line * WIDTH;
+    }
+    else {
+        screen = gb->screen + gb->current_line * WIDTH;
+    }
+    if (gb->bg_screen) {
+        bg_screen = gb->bg_screen + gb->current_line * WIDTH;
+    }
+
+    cached_line_t *cached = NULL;
+    if (gb->line_cache && (screen || indexed_screen || sgb_screen)) {
+        cached = &gb->line_cache->lines[gb->current_line];
+        line_signature_t signature;
+        memset(&signature, 0, sizeof(signature));
+        signature.tile_data_generation = gb->vram_tile_data_generation;
+        if (screen || bg_screen) {
+            signature.palette_generation = gb->palette_generation;
+        }
+        uint8_t bg_y = gb->current_line + gb->io_registers[GB_IO_SCY];
+        signature.map_row_generations[0] = gb->vram_map_row_generations[((lcdc & 0x08)? 32 : 0) + bg_y / 8];
+        if (window_start < WIDTH) {
+            signature.window_y = gb->current_line - gb->io_registers[GB_IO_WY] - gb->wy_diff;
+            signature.map_row_generations[1] = gb->vram_map_row_generations[((lcdc & 0x40)? 32 : 0) +
+                                                                            signature.window_y / 8];
+        }
+        if (lcdc & 2) {
+            signature.n_objects = gb->n_visible_objs;
+            for (unsigned i = 0; i < gb->n_visible_objs; i++) {
+                signature.object_indices[i] = gb->visible_objs[i];
+                signature.objects[i] = ((GB_object_t *) &gb->oam)[gb->visible_objs[i]];
+            }
+        }
+        signature.lcdc = lcdc;
+        signature.scx = gb->io_registers[GB_IO_SCX];
+        signature.scy = gb->io_registers[GB_IO_SCY];
+        signature.bgp = gb->io_registers[GB_IO_BGP];
+        signature.obp0 = gb->io_registers[GB_IO_OBP0];
+        signature.obp1 = gb->io_registers[GB_IO_OBP1];
+        signature.window_start = window_start;
+        signature.output = (screen? LINE_OUTPUT_SCREEN : 0) | (indexed_screen? LINE_OUTPUT_INDEXED : 0) |
+                           (sgb_screen? LINE_OUTPUT_SGB : 0) | (bg_screen? LINE_OUTPUT_BG_SCREEN : 0);
+        signature.cgb_mode = cgb_mode;
+
+        if (cached->valid && memcmp(&cached->signature, &signature, sizeof(signature)) == 0) {
+            if (screen) {
+                memcpy(screen, cached->pixels, WIDTH * sizeof(*screen));
+            }
+            else {
+                memcpy(indexed_screen? indexed_screen : sgb_screen, cached->pixels, WIDTH);
+            }
+            if (bg_screen) {
+                memcpy(bg_screen, cached->bg_pixels, WIDTH * sizeof(*bg_screen));
+            }
+            return true;
+        }
+        cached->signature = signature;
+    }
+
+    /* Background and window, decoded a tile at a time. The first pixel of the line is at scx & 7. Attributes are
+       the CGB tile attributes of every pixel. */
+    uint8_t bg_pixels[WIDTH + 16];
+    uint8_t bg_attributes[WIDTH + 16];
+    uint8_t rows[(WIDTH + 16) / 8 * 2];
+    uint8_t scx = gb->io_registers[GB_IO_SCX];
+    uint8_t y = gb->current_line + gb->io_registers[GB_IO_SCY];
+    uint16_t map = (lcdc & 0x08)? 0x1C00 : 0x1800;
+    unsigned tiles = (window_start + (scx & 7) + 7) / 8;
+    for (unsigned i = 0; i < tiles; i++) {
+        fetch_scanline_tile(gb, rows + i * 2, bg_attributes + i * 8, map, ((scx / 8) + i) & 0x1F, y, is_cgb);
+    }
+    if (tiles) {
+        decode_tile_rows(rows, bg_pixels, tiles, false);
+    }
+
+    unsigned bg_offset = scx & 7;
+    if (window_start < WIDTH) {
+        y = gb->current_line - gb->io_registers[GB_IO_WY] - gb->wy_diff;
+        map = (lcdc & 0x40)? 0x1C00 : 0x1800;
+        tiles = (WIDTH - window_start + 7) / 8;
+        for (unsigned i = 0; i < tiles; i++) {
+            fetch_scanline_tile(gb, rows + i * 2, bg_attributes + bg_offset + window_start + i * 8, map, i, y, is_cgb);
+        }
+        decode_tile_rows(rows, bg_pixels + bg_offset + window_start, tiles, false);
+    }
+
+    /* Objects, overlaid in the same order the FIFO fetches them. Objects are only drawn if enabled for the entire
+       line, and ones at X >= 168 are never fetched within the visible part of the line. The object buffers are
+       offset by 8, so an object at X is drawn starting at index X. */
+    uint8_t object_pixels[WIDTH + 16];
+    uint8_t object_attributes[WIDTH + 16]; // Palette, and the BG priority bit in bit 7
+    uint8_t object_priorities[WIDTH + 16];
+    bool objects_drawn = (lcdc & 2) && gb->n_visible_objs;
+    if (objects_drawn) {
+        memset(object_pixels, 0, sizeof(object_pixels));
+        GB_object_t *objects = (GB_object_t *) &gb->oam;
+        bool height_16 = (lcdc & 4) != 0;
+        GB_object_t *fetched[10];
+        unsigned n_fetched = 0;
+        for (unsigned i = gb->n_visible_objs; i--;) {
+            GB_object_t *object = &objects[gb->visible_objs[i]];
+            if (object->x >= WIDTH + 8) continue;
+
+            uint8_t tile_y = (gb->current_line - object->y) & (height_16? 0xF : 7);
+            if (object->flags & 0x40) { /* Flip Y */
+                tile_y ^= height_16? 0xF : 7;
+            }
+            uint16_t line_address = (height_16? object->tile & 0xFE : object->tile) * 0x10 + tile_y * 2;
+            if (cgb_mode && (object->flags & 0x8)) { /* Use VRAM bank 2 */
+                line_address += 0x2000;
+            }
+            rows[n_fetched * 2] = gb->vram[line_address];
+            rows[n_fetched * 2 + 1] = gb->vram[line_address + 1];
+            if (object->flags & 0x20) {
+                rows[n_fetched * 2] = flip_bits(rows[n_fetched * 2]);
+                rows[n_fetched * 2 + 1] = flip_bits(rows[n_fetched * 2 + 1]);
+            }
+            fetched[n_fetched++] = object;
+        }
+
+        uint8_t fetched_pixels[10 * 8];
+        decode_tile_rows(rows, fetched_pixels, n_fetched, false);
+        for (unsigned i = 0; i < n_fetched; i++) {
+            GB_object_t *object = fetched[i];
+            uint8_t attributes = (object->flags & 0x10) ? 1 : 0;
+            if (cgb_mode) {
+                attributes = object->flags & 0x7;
+            }
+            attributes |= object->flags & 0x80;
+            uint8_t priority = cgb_mode? object - objects : 0;
+
+            UNROLL
+            for (unsigned j = 0; j < 8; j++) {
+                uint8_t pixel = fetched_pixels[i * 8 + j];
+                unsigned target = object->x + j;
+                if (pixel != 0 && (object_pixels[target] == 0 || object_priorities[target] > priority)) {
+                    object_pixels[target] = pixel;
+                    object_attributes[target] = attributes;
+                    object_priorities[target] = priority;
+                }
+            }
+        }
+    }
+
+    /* Mixing, same as render_pixel_if_possible but with the per-line decisions taken out of the loop. Everything
+       read from gb is loaded beforehand, since writes to the output buffers could otherwise alias it. */
+    bool bg_enabled = (lcdc & 1) || cgb_mode;
+    bool window_bg_enabled = bg_enabled || !is_cgb;
+    bool bg_priority_enabled = (lcdc & 1) || !cgb_mode;
+    uint8_t bg_map[4], object_map[2][4];
+    for (unsigned i = 0; i < 4; i++) {
+        if (cgb_mode) {
+            bg_map[i] = object_map[0][i] = object_map[1][i] = i;
+        }
+        else {
+            bg_map[i] = (gb->io_registers[GB_IO_BGP] >> (i << 1)) & 3;
+            object_map[0][i] = (gb->io_registers[GB_IO_OBP0] >> (i << 1)) & 3;
+            object_map[1][i] = (gb->io_registers[GB_IO_OBP1] >> (i << 1)) & 3;
+        }
+    }
+    const uint32_t *background_palettes = gb->background_palettes_rgb;
+    const uint32_t *sprite_palettes = gb->sprite_palettes_rgb;
+
+    for (unsigned x = 0; x < WIDTH; x++) {
+        uint8_t bg_attribute = bg_attributes[x + bg_offset];
+        uint8_t pixel = (x < window_start? bg_enabled : window_bg_enabled)? bg_pixels[x + bg_offset] : 0;
+        bool draw_oam = objects_drawn && object_pixels[x + 8] != 0 &&
+                        !(pixel && bg_priority_enabled && ((bg_attribute | object_attributes[x + 8]) & 0x80));
+
+        pixel = bg_map[pixel];
+        uint8_t index = GB_INDEXED_BACKGROUND + (bg_attribute & 7) * 4 + pixel;
+        uint32_t color = background_palettes[(bg_attribute & 7) * 4 + pixel];
+        if (bg_screen) {
+            bg_screen[x] = color;
+        }
+        if (draw_oam) {
+            uint8_t palette = object_attributes[x + 8] & 7;
+            pixel = object_map[palette & 1][object_pixels[x + 8]];
+            index = GB_INDEXED_OBJECT + palette * 4 + pixel;
+            color = sprite_palettes[palette * 4 + pixel];
+        }
+        if (screen) {
+            screen[x] = color;
+        }
+        else if (indexed_screen) {
+            indexed_screen[x] = index;
+        }
+        else if (sgb_screen) {
+            sgb_screen[x] = pixel;
+        }
+    }
+
+    if (cached) {
+        if (screen) {
+            memcpy(cached->pixels, screen, WIDTH * sizeof(*screen));
+        }
+        else {
+            memcpy(cached->pixels, indexed_screen? indexed_screen : sgb_screen, WIDTH);
+        }
+        if (bg_screen) {
+            memcpy(cached->bg_pixels, bg_screen, WIDTH * sizeof(*bg_screen));
+        }
+        cached->valid = true;
+    }
+
+    return true;
+}
+
+/* Mode 3 timing without pixels. This follows the control flow of the rendering loop in GB_display_run exactly, but
+   only keeps track of what affects its length: the position in the line, the fetcher state, the size of the
+   background FIFO and the object comparators. Each step is an iteration of the loop, or the continuation of an
+   object fetch after one of its sleeps. */
+
+typedef enum {
+    GB_MODE_3_ITERATION,
+    GB_MODE_3_OBJECT_WAIT,
+    GB_MODE_3_OBJECT_PENALTY,
+    GB_MODE_3_OBJECT_FETCH,
+    GB_MODE_3_DONE,
+} GB_mode_3_step_t;
+
+typedef struct {
+    uint16_t cycles;
+    uint8_t step;
+    uint8_t position_in_line;
+    uint8_t fetcher_state;
+    uint8_t bg_fifo_size;
+    bool bg_fifo_paused;
+    bool in_window;
+    uint8_t n_visible_objs;
+    uint8_t extra_penalty_for_sprite_at_0;
+} mode_3_timing_t;
+
+static mode_3_timing_t load_mode_3_timing(GB_gameboy_t *gb)
+{
+    return (mode_3_timing_t) {
+        .cycles = gb->mode_3_cycles,
+        .step = gb->mode_3_step,
+        .position_in_line = gb->position_in_line,
+        .fetcher_state = gb->fetcher_state,
+        .bg_fifo_size = gb->bg_fifo.size,
+        .bg_fifo_paused = gb->bg_fifo_paused,
+        .in_window = gb->in_window,
+        .n_visible_objs = gb->n_visible_objs,
+        .extra_penalty_for_sprite_at_0 = gb->extra_penalty_for_sprite_at_0,
+    };
+}
+
+static void store_mode_3_timing(GB_gameboy_t *gb, const mode_3_timing_t *timing)
+{
+    gb->mode_3_cycles = timing->cycles;
+    gb->mode_3_step = timing->step;
+    gb->position_in_line = timing->position_in_line;
+    gb->fetcher_state = timing->fetcher_state;
+    /* Only the size of the FIFO is tracked, its contents are never drawn while rendering is disabled */
+    gb->bg_fifo.size = timing->bg_fifo_size;
+    gb->bg_fifo_paused = timing->bg_fifo_paused;
+    gb->in_window = timing->in_window;
+    gb->n_visible_objs = timing->n_visible_objs;
+    gb->extra_penalty_for_sprite_at_0 = timing->extra_penalty_for_sprite_at_0;
+}
+
+/* Runs the steps that occur before the given cycle, or until the end of mode 3 */
+static void simulate_mode_3(GB_gameboy_t *gb, mode_3_timing_t *timing, uint16_t until)
+{
+    while (timing->cycles < until) {
+        /* The object conditions are not checked again while waiting for the fetcher */
+        bool waiting = timing->step == GB_MODE_3_OBJECT_WAIT;
+        switch ((GB_mode_3_step_t)timing->step) {
+            case GB_MODE_3_ITERATION:
+                while (timing->n_visible_objs != 0 &&
+                       (timing->position_in_line < 160 || timing->position_in_line >= (uint8_t)(-8)) &&
+                       gb->obj_comparators[timing->n_visible_objs - 1] < (uint8_t)(timing->position_in_line + 8)) {
+                    timing->n_visible_objs--;
+                }
+                break;
+            case GB_MODE_3_OBJECT_WAIT:
+                break;
+            case GB_MODE_3_OBJECT_PENALTY:
+                timing->step = GB_MODE_3_OBJECT_FETCH;
+                timing->cycles += 6;
+                continue;
+            case GB_MODE_3_OBJECT_FETCH:
+                timing->n_visible_objs--;
+                break;
+            case GB_MODE_3_DONE:
+                return;
+        }
+
+        if (waiting || (timing->n_visible_objs != 0 &&
+                        (gb->io_registers[GB_IO_LCDC] & 2 || GB_is_cgb(gb)) &&
+                        gb->obj_comparators[timing->n_visible_objs - 1] == (uint8_t)(timing->position_in_line + 8))) {
+            /* The fetcher never reaches the push step while waiting */
+            if (timing->fetcher_state < 5) {
+                timing->fetcher_state++;
+                timing->step = GB_MODE_3_OBJECT_WAIT;
+                timing->cycles++;
+                continue;
+            }
+            if (timing->extra_penalty_for_sprite_at_0 != 0 && gb->obj_comparators[timing->n_visible_objs - 1] == 0) {
+                timing->step = GB_MODE_3_OBJECT_PENALTY;
+                timing->cycles += timing->extra_penalty_for_sprite_at_0;
+                timing->extra_penalty_for_sprite_at_0 = 0;
+                continue;
+            }
+            timing->step = GB_MODE_3_OBJECT_FETCH;
+            timing->cycles += 6;
+            continue;
+        }
+
+        if (!timing->in_window && window_enabled(gb) &&
+            gb->current_line >= gb->io_registers[GB_IO_WY] + gb->wy_diff &&
+            (uint8_t)(timing->position_in_line + 7) == gb->io_registers[GB_IO_WX]) {
+            timing->in_window = true;
+            timing->bg_fifo_size = 0;
+            timing->bg_fifo_paused = true;
+            timing->fetcher_state = 0;
+        }
+
+        /* render_pixel_if_possible */
+        if (!timing->bg_fifo_paused && timing->bg_fifo_size) {
+            timing->bg_fifo_size--;
+        }
+        if (timing->position_in_line >= 160 || gb->disable_rendering || !timing->bg_fifo_paused) {
+            timing->position_in_line++;
+        }
+
+        /* advance_fetcher_state_machine */
+        if (timing->fetcher_state == 7) {
+            if (timing->bg_fifo_size == 0) {
+                timing->bg_fifo_size = 8;
+                timing->bg_fifo_paused = false;
+                timing->fetcher_state = 0;
+            }
+        }
+        else {
+            timing->fetcher_state++;
+        }
+
+        if (timing->position_in_line == 160) {
+            timing->step = GB_MODE_3_DONE;
+            return;
+        }
+        timing->step = GB_MODE_3_ITERATION;
+        timing->cycles++;
+    }
+}
+
+static uint16_t mode_3_length(GB_gameboy_t *gb)
+{
+    mode_3_timing_t timing = load_mode_3_timing(gb);
+    simulate_mode_3(gb, &timing, UINT16_MAX);
+    return timing.cycles;
+}
+
+/* A step at cycle c of mode 3 has already occurred if display_cycles + mode_3_length * 2 > c * 2, as it would have in
+   the rendering loop, which sleeps a cycle at a time. */
+void GB_display_sync_mode_3(GB_gameboy_t *gb)
+{
+    if (!gb->mode_3_timing_only) return;
+    mode_3_timing_t timing = load_mode_3_timing(gb);
+    int32_t now = gb->display_cycles + gb->mode_3_length * 2;
+    simulate_mode_3(gb, &timing, (now + 1) / 2);
+    store_mode_3_timing(gb, &timing);
+}
+
+void GB_display_reschedule_mode_3(GB_gameboy_t *gb)
+{
+    if (!gb->mode_3_timing_only) return;
+    int16_t delta = mode_3_length(gb) - gb->mode_3_length;
+    gb->mode_3_length += delta;
+    gb->cycles_for_line += delta;
+    gb->display_cycles -= delta * 2;
+}
+
 /*
  TODO: It seems that the STAT register's mode bits are always "late" by 4 T-cycles.
        The PPU logic can be greatly simplified if that delay is simply emulated.
@@ -598,6 +1436,7 @@ void GB_display_run(GB_gameboy_t *gb, uint8_t cycles)
         GB_STATE(gb, display, 36);
         GB_STATE(gb, display, 37);
         GB_STATE(gb, display, 38);
+        GB_STATE(gb, display, 39);
 
     }
     
@@ -695,6 +1534,10 @@ void GB_display_run(GB_gameboy_t *gb, uint8_t cycles)
             gb->mode_for_interrupt = -1;
             GB_STAT_update(gb);
             gb->n_visible_objs = 0;
+            if (gb->current_line == 0) {
+                /* Picks up OAM modified directly by the frontend */
+                GB_display_update_object_index(gb, 0, 40);
+            }
             
             for (gb->oam_search_index = 0; gb->oam_search_index < 40; gb->oam_search_index++) {
                 if (GB_is_cgb(gb)) {
@@ -742,7 +1585,7 @@ void GB_display_run(GB_gameboy_t *gb, uint8_t cycles)
         mode_3_start:
 
             fifo_clear(&gb->bg_fifo);
-            fifo_clear(&gb->oam_fifo);
+            oam_fifo_clear(&gb->oam_fifo);
             /* Fill the FIFO with 8 pixels of "junk", it's going to be dropped anyway. */
             fifo_push_bg_row(&gb->bg_fifo, 0, 0, 0, false, false);
             /* Todo: find out actual access time of SCX */
@@ -753,6 +1596,16 @@ void GB_display_run(GB_gameboy_t *gb, uint8_t cycles)
             }
             gb->fetcher_x = ((gb->io_registers[GB_IO_SCX]) / 8) & 0x1f;
             gb->extra_penalty_for_sprite_at_0 = (gb->io_registers[GB_IO_SCX] & 7);
+            if (gb->indexed_screen && !gb->sgb) {
+                /* A new frame starts here even if rendering is disabled, so appends never carry over */
+                if (gb->current_line == 0) {
+                    gb->indexed_palettes->count = 0;
+                }
+                if (!gb->disable_rendering) {
+                    update_indexed_palette(gb, gb->current_line);
+                }
+            }
+            gb->scanline_rendered = render_scanline(gb);
 
             
             /* The actual rendering cycle */
@@ -760,7 +1613,18 @@ void GB_display_run(GB_gameboy_t *gb, uint8_t cycles)
             gb->bg_fifo_paused = false;
             gb->oam_fifo_paused = false;
             gb->in_window = false;
-            while (true) {
+            if (gb->disable_rendering) {
+                /* Only the length of mode 3 matters, so it's simulated at once rather than slept through a cycle at
+                   a time. Writes that change it resimulate it from the cycle they occur at. */
+                gb->mode_3_timing_only = true;
+                gb->mode_3_step = GB_MODE_3_ITERATION;
+                gb->mode_3_cycles = 0;
+                gb->mode_3_length = mode_3_length(gb);
+                gb->cycles_for_line += gb->mode_3_length;
+                GB_SLEEP(gb, display, 39, gb->mode_3_length);
+                gb->mode_3_timing_only = false;
+            }
+            else while (true) {
                 /* Handle objects */
                 /* When the sprite enabled bit is off, this proccess is skipped entirely on the DMG, but not on the CGB.
                    On the CGB, this bit is checked only when the pixel is actually popped from the FIFO. */
@@ -845,6 +1709,10 @@ void GB_display_run(GB_gameboy_t *gb, uint8_t cycles)
                 GB_SLEEP(gb, display, 21, 1);
             }
             
+            if (gb->dirty_lines_tracking && !gb->sgb && !gb->disable_rendering) {
+                update_line_hash(gb, gb->current_line);
+            }
+            
             if (GB_is_cgb(gb) && gb->model <= GB_MODEL_CGB_C) {
                 gb->cycles_for_line++;
                 GB_SLEEP(gb, display, 30, 1);
@@ -980,30 +1848,38 @@ void GB_draw_tileset(GB_gameboy_t *gb, uint32_t *dest, GB_palette_type_t palette
             break;
     }
     
-    for (unsigned y = 0; y < 192; y++) {
-        for (unsigned x = 0; x < 256; x++) {
-            if (x >= 128 && !GB_is_cgb(gb)) {
-                *(dest++) = gb->background_palettes_rgb[0];
-                continue;
+    uint32_t colors[4];
+    for (unsigned i = 0; i < 4; i++) {
+        uint8_t pixel = i;
+        if (!gb->cgb_mode) {
+            if (palette_type == GB_PALETTE_BACKGROUND) {
+                pixel = ((gb->io_registers[GB_IO_BGP] >> (pixel << 1)) & 3);
             }
-            uint16_t tile = (x % 128) / 8 + y / 8 * 16;
-            uint16_t tile_address = tile * 0x10 + (x >= 128? 0x2000 : 0);
-            uint8_t pixel = (((gb->vram[tile_address + (y & 7) * 2    ] >> ((~x)&7)) & 1 ) |
-                             ((gb->vram[tile_address + (y & 7) * 2 + 1] >> ((~x)&7)) & 1) << 1);
-            
-            if (!gb->cgb_mode) {
-                if (palette_type == GB_PALETTE_BACKGROUND) {
-                    pixel = ((gb->io_registers[GB_IO_BGP] >> (pixel << 1)) & 3);
-                }
-                else if (!gb->cgb_mode) {
-                    if (palette_type == GB_PALETTE_OAM) {
-                        pixel = ((gb->io_registers[palette_index == 0? GB_IO_OBP0 : GB_IO_OBP1] >> (pixel << 1)) & 3);
-                    }
+            else if (palette_type == GB_PALETTE_OAM) {
+                pixel = ((gb->io_registers[palette_index == 0? GB_IO_OBP0 : GB_IO_OBP1] >> (pixel << 1)) & 3);
+            }
+        }
+        colors[i] = palette[pixel];
+    }
+    
+    /* 24 rows of 32 tiles, the right half is the second VRAM bank */
+    for (unsigned tile = 0; tile < 24 * 32; tile++) {
+        uint32_t *tile_dest = dest + (tile / 32) * 8 * 256 + (tile % 32) * 8;
+        if (tile % 32 >= 16 && !GB_is_cgb(gb)) {
+            for (unsigned y = 0; y < 8; y++) {
+                for (unsigned x = 0; x < 8; x++) {
+                    tile_dest[x + y * 256] = gb->background_palettes_rgb[0];
                 }
             }
-            
-            
-            *(dest++) = palette[pixel];
+            continue;
+        }
+        
+        uint8_t pixels[64];
+        decode_tile_rows(gb->vram + ((tile % 16) + (tile / 32) * 16) * 0x10 + (tile % 32 >= 16? 0x2000 : 0), pixels, 8, false);
+        for (unsigned y = 0; y < 8; y++) {
+            for (unsigned x = 0; x < 8; x++) {
+                tile_dest[x + y * 256] = colors[pixels[x + y * 8]];
+            }
         }
     }
 }
@@ -1040,39 +1916,51 @@ void GB_draw_tilemap(GB_gameboy_t *gb, uint32_t *dest, GB_palette_type_t palette
         tileset_type = (gb->io_registers[GB_IO_LCDC] & 0x10)? GB_TILESET_8800 : GB_TILESET_8000;
     }
     
-    for (unsigned y = 0; y < 256; y++) {
-        for (unsigned x = 0; x < 256; x++) {
-            uint8_t tile = gb->vram[map + x/8 + y/8 * 32];
-            uint16_t tile_address;
-            uint8_t attributes = 0;
-            
-            if (tileset_type == GB_TILESET_8800) {
-                tile_address = tile * 0x10;
-            }
-            else {
-                tile_address = (int8_t) tile * 0x10 + 0x1000;
-            }
-            
-            if (gb->cgb_mode) {
-                attributes = gb->vram[map + x/8 + y/8 * 32 + 0x2000];
-            }
-            
-            if (attributes & 0x8) {
-                tile_address += 0x2000;
-            }
-            
-            uint8_t pixel = (((gb->vram[tile_address + (((attributes & 0x40)? ~y : y) & 7) * 2    ] >> (((attributes & 0x20)? x : ~x)&7)) & 1 ) |
-                             ((gb->vram[tile_address + (((attributes & 0x40)? ~y : y) & 7) * 2 + 1] >> (((attributes & 0x20)? x : ~x)&7)) & 1) << 1);
-            
-            if (!gb->cgb_mode && (palette_type == GB_PALETTE_BACKGROUND || palette_type == GB_PALETTE_AUTO)) {
-                pixel = ((gb->io_registers[GB_IO_BGP] >> (pixel << 1)) & 3);
-            }
-            
+    uint8_t pixel_map[4];
+    for (unsigned i = 0; i < 4; i++) {
+        pixel_map[i] = i;
+        if (!gb->cgb_mode && (palette_type == GB_PALETTE_BACKGROUND || palette_type == GB_PALETTE_AUTO)) {
+            pixel_map[i] = ((gb->io_registers[GB_IO_BGP] >> (i << 1)) & 3);
+        }
+    }
+    
+    for (unsigned tile_index = 0; tile_index < 32 * 32; tile_index++) {
+        uint8_t tile = gb->vram[map + tile_index];
+        uint16_t tile_address;
+        uint8_t attributes = 0;
+        
+        if (tileset_type == GB_TILESET_8800) {
+            tile_address = tile * 0x10;
+        }
+        else {
+            tile_address = (int8_t) tile * 0x10 + 0x1000;
+        }
+        
+        if (gb->cgb_mode) {
+            attributes = gb->vram[map + tile_index + 0x2000];
+        }
+        
+        if (attributes & 0x8) {
+            tile_address += 0x2000;
+        }
+        
+        uint32_t colors[4];
+        for (unsigned i = 0; i < 4; i++) {
             if (palette) {
-                *(dest++) = palette[pixel];
+                colors[i] = palette[pixel_map[i]];
             }
             else {
-                *(dest++) = gb->background_palettes_rgb[(attributes & 7) * 4 + pixel];
+                colors[i] = gb->background_palettes_rgb[(attributes & 7) * 4 + pixel_map[i]];
+            }
+        }
+        
+        uint8_t pixels[64];
+        decode_tile_rows(gb->vram + tile_address, pixels, 8, attributes & 0x20);
+        uint32_t *tile_dest = dest + (tile_index / 32) * 8 * 256 + (tile_index % 32) * 8;
+        uint8_t y_flip = (attributes & 0x40)? 7 : 0;
+        for (unsigned y = 0; y < 8; y++) {
+            for (unsigned x = 0; x < 8; x++) {
+                tile_dest[x + y * 256] = colors[pixels[x + (y ^ y_flip) * 8]];
             }
         }
     }
@@ -1082,15 +1970,15 @@ uint8_t GB_get_oam_info(GB_gameboy_t *gb, GB_oam_info_t *dest, uint8_t *sprite_h
 {
     uint8_t count = 0;
     *sprite_height = (gb->io_registers[GB_IO_LCDC] & 4) ? 16:8;
+    /* OAM might have been edited through GB_get_direct_access */
+    GB_display_update_object_index(gb, 0, 40);
     uint8_t oam_to_dest_index[40] = {0,};
     for (unsigned y = 0; y < LINES; y++) {
-        GB_object_t *sprite = (GB_object_t *) &gb->oam;
         uint8_t sprites_in_line = 0;
-        for (uint8_t i = 0; i < 40; i++, sprite++) {
-            int sprite_y = sprite->y - 16;
+        for (uint64_t in_line = gb->objects_on_line[*sprite_height == 16][y]; in_line; in_line &= in_line - 1) {
+            unsigned i = __builtin_ctzll(in_line);
+            GB_object_t *sprite = (GB_object_t *) &gb->oam + i;
             bool obscured = false;
-            // Is sprite not in this line?
-            if (sprite_y > y || sprite_y + *sprite_height <= y) continue;
             if (++sprites_in_line == 11) obscured = true;
             
             GB_oam_info_t *info = NULL;
@@ -1119,27 +2007,34 @@ uint8_t GB_get_oam_info(GB_gameboy_t *gb, GB_oam_info_t *dest, uint8_t *sprite_h
             vram_address += 0x2000;
         }
 
+        uint32_t colors[4];
+        for (unsigned j = 0; j < 4; j++) {
+            uint8_t color = j;
+            if (!gb->cgb_mode) {
+                color = (gb->io_registers[palette? GB_IO_OBP1:GB_IO_OBP0] >> (color << 1)) & 3;
+            }
+            colors[j] = gb->sprite_palettes_rgb[palette * 4 + color];
+        }
+        
+        uint8_t pixels[16 * 8];
+        decode_tile_rows(gb->vram + vram_address, pixels, *sprite_height, flags & 0x20);
         for (unsigned y = 0; y < *sprite_height; y++) {
+            const uint8_t *row = pixels + ((flags & 0x40)? *sprite_height - 1 - y : y) * 8;
             UNROLL
             for (unsigned x = 0; x < 8; x++) {
-                uint8_t color = (((gb->vram[vram_address    ] >> ((~x)&7)) & 1 ) |
-                                 ((gb->vram[vram_address + 1] >> ((~x)&7)) & 1) << 1 );
-                
-                if (!gb->cgb_mode) {
-                    color = (gb->io_registers[palette? GB_IO_OBP1:GB_IO_OBP0] >> (color << 1)) & 3;
-                }
-                dest[i].image[((flags & 0x20)?7-x:x) + ((flags & 0x40)?*sprite_height - 1 -y:y) * 8] = gb->sprite_palettes_rgb[palette * 4 + color];
+                dest[i].image[x + y * 8] = colors[row[x]];
             }
-            vram_address += 2;
         }
     }
     return count;
 }
 
-/* Called when a write might enable or disable the window */
+/* Called when a write might enable, disable or move the window */
 void GB_window_related_write(GB_gameboy_t *gb, uint8_t addr, uint8_t value)
 {
+    GB_display_sync_mode_3(gb);
     bool before = window_enabled(gb);
+    gb->scanline_rendered = false;
     gb->io_registers[addr] = value;
     bool after = window_enabled(gb);
     
@@ -1162,4 +2057,5 @@ void GB_window_related_write(GB_gameboy_t *gb, uint8_t addr, uint8_t value)
             }
         }
     }
+    GB_display_reschedule_mode_3(gb);
 }
@@ -9,8 +9,15 @@
 void GB_display_run(GB_gameboy_t *gb, uint8_t cycles);
 void GB_palette_changed(GB_gameboy_t *gb, bool background_palette, uint8_t index);
 void GB_window_related_write(GB_gameboy_t *gb, uint8_t addr, uint8_t value);
+/* Must be called before and after changing anything else that affects the length of mode 3 */
+void GB_display_sync_mode_3(GB_gameboy_t *gb);
+void GB_display_reschedule_mode_3(GB_gameboy_t *gb);
 void GB_STAT_update(GB_gameboy_t *gb);
 void GB_lcd_off(GB_gameboy_t *gb);
+unsigned GB_display_uneventful_cycles(GB_gameboy_t *gb);
+void GB_display_invalidate_line_cache(GB_gameboy_t *gb);
+/* Must be called after modifying the Y positions of objects in OAM */
+void GB_display_update_object_index(GB_gameboy_t *gb, unsigned first, unsigned count);
 #endif
 
 typedef enum {
@@ -51,4 +58,31 @@ void GB_draw_tilemap(GB_gameboy_t *gb, uint32_t *dest, GB_palette_type_t palette
 uint8_t GB_get_oam_info(GB_gameboy_t *gb, GB_oam_info_t *dest, uint8_t *sprite_height);
 uint32_t GB_convert_rgb15(GB_gameboy_t *gb, uint16_t color);
 void GB_set_color_correction_mode(GB_gameboy_t *gb, GB_color_correction_mode_t mode);
+
+/* Palette-indexed output. When set, the PPU writes a byte per pixel instead of a host color, which indexes the colors
+   of the palettes the pixel's line was drawn with. Host colors are only looked up by GB_expand_indexed_pixels, or by
+   the frontend itself using GB_get_indexed_palette. Palettes can't be modified while a line is drawn, so every line
+   has a single set of colors; lines that share the same colors share the same table within a frame. Not used by the
+   Super Game Boy, which always outputs host colors. */
+#define GB_INDEXED_BACKGROUND 0 // + palette * 4 + color
+#define GB_INDEXED_OBJECT 32 // + palette * 4 + color, palettes 0-1 on a DMG
+#define GB_INDEXED_WHITE 64 // The LCD is off
+#define GB_INDEXED_BLACK 65 // The LCD is on, but the CPU is stopped
+#define GB_INDEXED_COLORS 66
+
+void GB_set_indexed_pixels_output(GB_gameboy_t *gb, uint8_t *output);
+const uint32_t *GB_get_indexed_palette(GB_gameboy_t *gb, unsigned line); /* GB_INDEXED_COLORS colors */
+void GB_expand_indexed_pixels(GB_gameboy_t *gb, const uint8_t *input, uint32_t *output);
+
+/* Which lines of the output differ from the last frame the vblank callback was called for, one bit per line (line n
+   is bit n % 32 of dirty[n / 32]). Lines are compared by a hash of their contents, taken as they're drawn. Tracking
+   starts with the first call, which reports every line. Every line of a Super Game Boy's output is always reported.
+   Returns false if no line changed, in which case the frame doesn't need to be presented again. */
+#define GB_DIRTY_LINES_WORDS 7 // Enough for the 224 lines of a Super Game Boy's output
+bool GB_get_dirty_lines(GB_gameboy_t *gb, uint32_t dirty[GB_DIRTY_LINES_WORDS]);
+
+/* Reuses the output of lines whose inputs (the VRAM rows and objects they use, the registers and the palettes) are the
+   same as when they were last drawn. Emulation results are identical, but VRAM must only be modified through the
+   emulated bus (GB_write_memory), not through pointers from GB_get_direct_access. */
+void GB_set_line_cache_enabled(GB_gameboy_t *gb, bool enabled);
 #endif /* display_h */
@@ -7,6 +7,7 @@
 #include <stdarg.h>
 #ifndef _WIN32
 #include <sys/select.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #endif
 #include "gb.h"
@@ -109,6 +110,7 @@ void GB_init(GB_gameboy_t *gb, GB_model_t model)
 #endif
     gb->cartridge_type = &GB_cart_defs[0]; // Default cartridge type
     gb->clock_multiplier = 1.0;
+    gb->idle_loop_detection = true;
     
     GB_reset(gb);
 }
@@ -130,8 +132,17 @@ void GB_free(GB_gameboy_t *gb)
     if (gb->mbc_ram) {
         free(gb->mbc_ram);
     }
-    if (gb->rom) {
-        free(gb->rom);
+    if (gb->rom_image) {
+        GB_rom_image_release(gb->rom_image);
+    }
+    if (gb->color_table) {
+        GB_color_table_release(gb->color_table);
+    }
+    if (gb->indexed_palettes) {
+        free(gb->indexed_palettes);
+    }
+    if (gb->line_cache) {
+        free(gb->line_cache);
     }
     if (gb->apu_output.buffer) {
         free(gb->apu_output.buffer);
@@ -145,6 +156,12 @@ void GB_free(GB_gameboy_t *gb)
     if (gb->nontrivial_jump_state) {
         free(gb->nontrivial_jump_state);
     }
+    if (gb->code_blocks) {
+        free(gb->code_blocks);
+    }
+    if (gb->idle_loop) {
+        free(gb->idle_loop);
+    }
 #ifndef DISABLE_DEBUGGER
     GB_debugger_clear_symbols(gb);
 #endif
@@ -173,6 +190,107 @@ void GB_load_boot_rom_from_buffer(GB_gameboy_t *gb, const unsigned char *buffer,
     memcpy(gb->boot_rom, buffer, size);
 }
 
+struct GB_rom_image_s {
+    uint8_t *data;
+    uint32_t size;
+    unsigned reference_count;
+    bool mapped;
+};
+
+/* Images are only padded to a whole bank, read_rom masks bank numbers and treats bytes past the end as 0xFF */
+static GB_rom_image_t *rom_image_alloc(size_t size)
+{
+    GB_rom_image_t *image = malloc(sizeof(*image));
+    image->size = size? (size + 0x3FFF) & ~0x3FFF : 0x4000; /* Round to bank */
+    image->data = malloc(image->size);
+    memset(image->data + size, 0xFF, image->size - size); /* Pad with 0xFFs */
+    image->reference_count = 1;
+    image->mapped = false;
+    return image;
+}
+
+static GB_rom_image_t *rom_image_read(FILE *f, bool allow_mapping)
+{
+    fseek(f, 0, SEEK_END);
+    size_t size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    
+#ifndef _WIN32
+    /* A file that doesn't need padding can be used as is */
+    if (allow_mapping && size && !(size & 0x3FFF)) {
+        void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (data != MAP_FAILED) {
+            GB_rom_image_t *image = malloc(sizeof(*image));
+            image->data = data;
+            image->size = size;
+            image->reference_count = 1;
+            image->mapped = true;
+            return image;
+        }
+    }
+#endif
+    
+    GB_rom_image_t *image = rom_image_alloc(size);
+    fread(image->data, size, 1, f);
+    return image;
+}
+
+GB_rom_image_t *GB_rom_image_create(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    GB_rom_image_t *image = rom_image_read(f, true);
+    fclose(f);
+    return image;
+}
+
+GB_rom_image_t *GB_rom_image_create_from_buffer(const unsigned char *buffer, size_t size)
+{
+    GB_rom_image_t *image = rom_image_alloc(size);
+    memcpy(image->data, buffer, size);
+    return image;
+}
+
+GB_rom_image_t *GB_rom_image_retain(GB_rom_image_t *image)
+{
+    __atomic_add_fetch(&image->reference_count, 1, __ATOMIC_RELAXED);
+    return image;
+}
+
+void GB_rom_image_release(GB_rom_image_t *image)
+{
+    if (__atomic_sub_fetch(&image->reference_count, 1, __ATOMIC_ACQ_REL)) return;
+#ifndef _WIN32
+    if (image->mapped) {
+        munmap(image->data, image->size);
+    }
+    else
+#endif
+    {
+        free(image->data);
+    }
+    free(image);
+}
+
+void GB_load_rom_image(GB_gameboy_t *gb, GB_rom_image_t *image)
+{
+    GB_rom_image_retain(image);
+    if (gb->rom_image) {
+        GB_rom_image_release(gb->rom_image);
+    }
+    gb->rom_image = image;
+    gb->rom = image->data;
+    gb->rom_size = image->size;
+    gb->rom_mask = image->size - 1;
+    /* Round to a power of two */
+    for (unsigned shift = 1; shift < 32; shift <<= 1) {
+        gb->rom_mask |= gb->rom_mask >> shift;
+    }
+    GB_configure_cart(gb);
+    GB_cpu_flush_code_blocks(gb);
+    GB_update_page_table(gb);
+}
+
 int GB_load_rom(GB_gameboy_t *gb, const char *path)
 {
     FILE *f = fopen(path, "rb");
@@ -180,27 +298,22 @@ int GB_load_rom(GB_gameboy_t *gb, const char *path)
         GB_log(gb, "Could not open ROM: %s.\n", strerror(errno));
         return errno;
     }
-    fseek(f, 0, SEEK_END);
-    gb->rom_size = (ftell(f) + 0x3FFF) & ~0x3FFF; /* Round to bank */
-    /* And then round to a power of two */
-    while (gb->rom_size & (gb->rom_size - 1)) {
-        /* I promise this works. */
-        gb->rom_size |= gb->rom_size >> 1;
-        gb->rom_size++;
-    }
-    fseek(f, 0, SEEK_SET);
-    if (gb->rom) {
-        free(gb->rom);
-    }
-    gb->rom = malloc(gb->rom_size);
-    memset(gb->rom, 0xFF, gb->rom_size); /* Pad with 0xFFs */
-    fread(gb->rom, gb->rom_size, 1, f);
+    /* A private, writable copy */
+    GB_rom_image_t *image = rom_image_read(f, false);
     fclose(f);
-    GB_configure_cart(gb);
+    GB_load_rom_image(gb, image);
+    GB_rom_image_release(image);
 
     return 0;
 }
 
+void GB_load_rom_from_buffer(GB_gameboy_t *gb, const unsigned char *buffer, size_t size)
+{
+    GB_rom_image_t *image = GB_rom_image_create_from_buffer(buffer, size);
+    GB_load_rom_image(gb, image);
+    GB_rom_image_release(image);
+}
+
 typedef struct {
     uint8_t seconds;
     uint8_t padding1[3];
@@ -438,7 +551,7 @@ void GB_set_async_input_callback(GB_gameboy_t *gb, GB_input_callback_t callback)
 }
 
 
-void GB_set_rgb_encode_callback(GB_gameboy_t *gb, GB_rgb_encode_callback_t callback)
+void GB_set_initial_dmg_colors(GB_gameboy_t *gb, GB_rgb_encode_callback_t callback)
 {
     if (!gb->rgb_encode_callback && !GB_is_cgb(gb)) {
         gb->sprite_palettes_rgb[4] = gb->sprite_palettes_rgb[0] = gb->background_palettes_rgb[0] =
@@ -450,7 +563,16 @@ void GB_set_rgb_encode_callback(GB_gameboy_t *gb, GB_rgb_encode_callback_t callb
         gb->sprite_palettes_rgb[7] = gb->sprite_palettes_rgb[3] = gb->background_palettes_rgb[3] =
         callback(gb, 0, 0, 0);
     }
+}
 
+void GB_set_rgb_encode_callback(GB_gameboy_t *gb, GB_rgb_encode_callback_t callback)
+{
+    /* The same callback might encode differently now (e.g. a new pixel format), never reuse colors it encoded */
+    if (gb->color_table) {
+        GB_color_table_release(gb->color_table);
+        gb->color_table = NULL;
+    }
+    GB_set_initial_dmg_colors(gb, callback);
     gb->rgb_encode_callback = callback;
     
     for (unsigned i = 0; i < 32; i++) {
@@ -552,7 +674,9 @@ void GB_set_turbo_mode(GB_gameboy_t *gb, bool on, bool no_frame_skip)
 
 void GB_set_rendering_disabled(GB_gameboy_t *gb, bool disabled)
 {
+    GB_display_sync_mode_3(gb);
     gb->disable_rendering = disabled;
+    GB_display_reschedule_mode_3(gb);
 }
 
 void *GB_get_user_data(GB_gameboy_t *gb)
@@ -637,6 +761,8 @@ void GB_reset(GB_gameboy_t *gb)
     gb->cgb_ram_bank = 1;
     gb->io_registers[GB_IO_JOYP] = 0xF;
     gb->mbc_ram_size = mbc_ram_size;
+    GB_display_invalidate_line_cache(gb);
+    GB_display_update_object_index(gb, 0, 40);
     if (GB_is_cgb(gb)) {
         gb->ram_size = 0x2000 * 8;
         gb->vram_size = 0x2000 * 2;
@@ -660,6 +786,8 @@ void GB_reset(GB_gameboy_t *gb)
         }
     }
     reset_ram(gb);
+    GB_cpu_flush_code_blocks(gb);
+    GB_update_page_table(gb);
     
     /* The serial interrupt always occur on the 0xF7th cycle of every 0x100 cycle since boot. */
     gb->serial_cycles = 0x100-0xF7;
@@ -738,6 +866,8 @@ void *GB_get_direct_access(GB_gameboy_t *gb, GB_direct_access_t access, size_t *
         case GB_DIRECT_ACCESS_ROM:
             *size = gb->rom_size;
             *bank = gb->mbc_rom_bank;
+            /* Memory mapped images are read only */
+            if (gb->rom_image && gb->rom_image->mapped) return NULL;
             return gb->rom;
         case GB_DIRECT_ACCESS_RAM:
             *size = gb->ram_size;
@@ -793,14 +923,28 @@ void GB_set_clock_multiplier(GB_gameboy_t *gb, double multiplier)
 }
 
 uint32_t GB_get_clock_rate(GB_gameboy_t *gb)
+{
+    return GB_get_unmultiplied_clock_rate(gb) * gb->clock_multiplier;
+}
+
+uint32_t GB_get_unmultiplied_clock_rate(GB_gameboy_t *gb)
 {
     if (gb->model == GB_MODEL_SGB_NTSC) {
-        return SGB_NTSC_FREQUENCY * gb->clock_multiplier;
+        return SGB_NTSC_FREQUENCY;
     }
     if (gb->model == GB_MODEL_SGB_PAL) {
-        return SGB_PAL_FREQUENCY * gb->clock_multiplier;
+        return SGB_PAL_FREQUENCY;
     }
-    return CPU_FREQUENCY * gb->clock_multiplier;
+    return CPU_FREQUENCY;
+}
+
+void GB_set_rtc_mode(GB_gameboy_t *gb, GB_rtc_mode_t mode)
+{
+    if (gb->rtc_mode == mode) return;
+    gb->rtc_mode = mode;
+    gb->rtc_cycles = 0;
+    /* Time that passed in the other mode shouldn't be counted again */
+    gb->last_rtc_second = time(NULL);
 }
 
 size_t GB_get_screen_width(GB_gameboy_t *gb)
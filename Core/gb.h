@@ -21,7 +21,7 @@
 #include "symbol_hash.h"
 #include "sgb.h"
 
-#define GB_STRUCT_VERSION 13
+#define GB_STRUCT_VERSION 14
 
 #ifdef GB_INTERNAL
 #define GB_MODEL_FAMILY_MASK 0xF00
@@ -59,6 +59,11 @@ typedef union {
     uint8_t data[5];
 } GB_rtc_time_t;
 
+typedef enum {
+    GB_RTC_MODE_SYNC_TO_HOST, // The RTC follows the host's clock, including while the emulator isn't running
+    GB_RTC_MODE_ACCURATE, // The RTC is driven by emulated cycles, so runs are deterministic
+} GB_rtc_mode_t;
+
 
 typedef enum {
     // GB_MODEL_DMG_0 = 0x000,
@@ -247,19 +252,30 @@ typedef struct {
 struct GB_breakpoint_s;
 struct GB_watchpoint_s;
 
+/* A read-only, reference counted ROM image that can be shared by several instances */
+typedef struct GB_rom_image_s GB_rom_image_t;
+
+/* A reference counted table of host colors, see GB_color_table_create */
+typedef struct GB_color_table_s GB_color_table_t;
+
+/* The pixel FIFOs are shift registers like on hardware, each plane holds one bit of each pixel's color, and the next
+   pixel to be popped is in the most significant bit */
 typedef struct {
-    uint8_t pixel; // Color, 0-3
-    uint8_t palette; // Palette, 0 - 7 (CGB); 0-1 in DMG (or just 0 for BG)
-    uint8_t priority; // Sprite priority – 0 in DMG, OAM index in CGB
-    bool bg_priority; // For sprite FIFO – the BG priority bit. For the BG FIFO – the CGB attributes priority bit
-} GB_fifo_item_t;
+    uint8_t lower;
+    uint8_t upper;
+    uint8_t size;
+    uint8_t palette; // Palette, 0 - 7 (CGB); 0 in DMG
+    bool bg_priority; // The CGB attributes priority bit
+} GB_bg_fifo_t;
 
-#define GB_FIFO_LENGTH 16
 typedef struct {
-    GB_fifo_item_t fifo[GB_FIFO_LENGTH];
-    uint8_t read_end;
-    uint8_t write_end;
-} GB_fifo_t;
+    uint8_t lower; // Transparent pixels are 0 in both planes, so popping an empty FIFO requires no special handling
+    uint8_t upper;
+    uint8_t bg_priority; // One bit per pixel, in the same order as the planes
+    uint8_t read_end; // The attributes of the next pixel to be popped
+    uint8_t palette[8]; // Palette, 0 - 7 (CGB); 0-1 in DMG
+    uint8_t priority[8]; // Sprite priority – 0 in DMG, OAM index in CGB
+} GB_oam_fifo_t;
 
 /* When state saving, each section is dumped independently of other sections.
    This allows adding data to the end of the section without worrying about future compatibility.
@@ -426,6 +442,7 @@ struct GB_gameboy_internal_s {
         GB_rtc_time_t rtc_real, rtc_latched;
         uint64_t last_rtc_second;
         bool rtc_latch;
+        uint32_t rtc_cycles; // In 8MHz units, only counted in GB_RTC_MODE_ACCURATE
     );
 
     /* Video Display */
@@ -457,7 +474,8 @@ struct GB_gameboy_internal_s {
         bool window_disabled_while_active;
         uint8_t current_line;
         uint16_t ly_for_comparison;
-        GB_fifo_t bg_fifo, oam_fifo;
+        GB_bg_fifo_t bg_fifo;
+        GB_oam_fifo_t oam_fifo;
         uint8_t fetcher_x;
         uint8_t fetcher_y;
         uint16_t cycles_for_line;
@@ -478,6 +496,11 @@ struct GB_gameboy_internal_s {
         bool lyc_interrupt_line;
         bool cgb_palettes_blocked;
         uint8_t current_lcd_line; // The LCD can go out of sync since the vsync signal is skipped in some cases.
+        /* Mode 3 timing while rendering is disabled, the FIFO state above is only updated when a write affects it */
+        bool mode_3_timing_only;
+        uint8_t mode_3_step;
+        uint16_t mode_3_cycles; // When the next step occurs, in cycles since the start of mode 3
+        uint16_t mode_3_length;
     );
 
     /* Unsaved data. This includes all pointers, as well as everything that shouldn't be on a save state */
@@ -485,7 +508,9 @@ struct GB_gameboy_internal_s {
     GB_SECTION(unsaved,
         /* ROM */
         uint8_t *rom;
-        uint32_t rom_size;
+        uint32_t rom_size; // A multiple of the bank size, not padded to a power of two
+        uint32_t rom_mask; // rom_size rounded up to a power of two, minus one. Bytes past rom_size read as 0xFF.
+        GB_rom_image_t *rom_image;
         const GB_cartridge_t *cartridge_type;
         enum {
             GB_STANDARD_MBC1_WIRING,
@@ -493,23 +518,61 @@ struct GB_gameboy_internal_s {
         } mbc1_wiring;
 
         unsigned pending_cycles;
+        
+        /* Cached interpreter */
+        struct GB_code_block_s *code_blocks;
+        struct GB_code_block_s *current_code_block;
+        uint8_t code_ram_pages[0x10]; // Bitmap of 256-byte RAM pages with cached code
+        
+        /* Idle loop detection */
+        bool idle_loop_detection;
+        struct GB_idle_loop_s *idle_loop;
+        uint8_t idle_loop_state;
+        uint16_t idle_loop_address;
+        
+        /* Instruction counting */
+        bool counting_instructions;
+        uint64_t instruction_count;
                
         /* Various RAMs */
         uint8_t *ram;
         uint8_t *vram;
         uint8_t *mbc_ram;
+        
+        /* Page table of directly accessible 256-byte pages, NULL if a page needs special handling */
+        uint8_t *read_pages[0x100];
+        uint8_t *write_pages[0x100];
 
         /* I/O */
         uint32_t *screen;
         uint32_t *bg_screen;
+        uint8_t *indexed_screen;
+        struct GB_indexed_palettes_s *indexed_palettes;
+        bool dirty_lines_tracking; // Enabled by the first call to GB_get_dirty_lines
+        uint64_t line_hashes[144];
+        uint64_t presented_line_hashes[144]; // As of the last frame the vblank callback was called for
+        uint32_t dirty_lines[GB_DIRTY_LINES_WORDS];
+        bool scanline_rendered; // The current line was drawn in one pass, the FIFO only draws pixels after a mid-line write
         uint32_t background_palettes_rgb[0x20];
         uint32_t sprite_palettes_rgb[0x20];
         GB_color_correction_mode_t color_correction_mode;
+        GB_color_table_t *color_table;
+        struct GB_line_cache_s *line_cache;
+        uint64_t objects_on_line[2][144]; // Bitmasks of the objects covering every line, for 8 and 16 pixel tall objects
+        uint8_t indexed_object_y[40]; // The Y positions objects_on_line currently reflects
+        /* Incremented whenever what they cover is modified, so unchanged lines can be detected without reading VRAM */
+        uint32_t vram_tile_data_generation;
+        uint32_t vram_map_row_generations[64]; // Both maps, 32-byte rows of tile numbers and their CGB attributes
+        uint32_t palette_generation;
         bool keys[4][GB_KEY_MAX];
                
         /* Timing */
         uint64_t last_sync;
         uint64_t cycles_since_last_sync; // In 8MHz units
+        uint64_t paced_frames;
+        uint64_t total_lateness; // In nanoseconds
+        uint64_t max_lateness;
+        uint32_t lateness_histogram[GB_LATENESS_BUCKETS];
 
         /* Audio */
         GB_apu_output_t apu_output;
@@ -562,6 +625,8 @@ struct GB_gameboy_internal_s {
         /* Watchpoints */
         uint16_t n_watchpoints;
         struct GB_watchpoint_s *watchpoints;
+        uint8_t read_watchpoint_bitmap[0x10000 / 8]; // One bit per address covered by any read watchpoint
+        uint8_t write_watchpoint_bitmap[0x10000 / 8];
 
         /* Symbol tables */
         GB_symbol_map_t *bank_symbols[0x200];
@@ -569,6 +634,7 @@ struct GB_gameboy_internal_s {
 
         /* Ticks command */
         unsigned long debugger_ticks;
+        unsigned long debugger_idle_loop_ticks; // Part of debugger_ticks spent replaying idle loops
                
         /* Rewind */
 #define GB_REWIND_FRAMES_PER_KEY 255
@@ -596,6 +662,7 @@ struct GB_gameboy_internal_s {
         bool vblank_just_occured; // For slow operations involving syscalls; these should only run once per vblank
         uint8_t cycles_since_run; // How many cycles have passed since the last call to GB_run(), in 8MHz units
         double clock_multiplier;
+        GB_rtc_mode_t rtc_mode;
    );
 };
     
@@ -652,6 +719,20 @@ void GB_set_user_data(GB_gameboy_t *gb, void *data);
 int GB_load_boot_rom(GB_gameboy_t *gb, const char *path);
 void GB_load_boot_rom_from_buffer(GB_gameboy_t *gb, const unsigned char *buffer, size_t size);
 int GB_load_rom(GB_gameboy_t *gb, const char *path);
+void GB_load_rom_from_buffer(GB_gameboy_t *gb, const unsigned char *buffer, size_t size);
+
+/* Unlike GB_load_rom, which makes a private copy for every instance, an image is loaded once and shared by all the
+   instances it is loaded into. An image created from a file is memory mapped when possible. Creating an image returns
+   a single reference, and each instance holds its own reference until another ROM is loaded or GB_free is called,
+   so the creator may release its reference right after loading. The ROM must not be modified through
+   GB_get_direct_access while it's loaded from a shared image, and GB_get_direct_access returns NULL for the ROM
+   while it's loaded from a memory mapped image, which is read only. Use GB_load_rom or GB_load_rom_from_buffer if
+   the ROM needs to be patched in memory. */
+GB_rom_image_t *GB_rom_image_create(const char *path); /* Returns NULL and sets errno on failure */
+GB_rom_image_t *GB_rom_image_create_from_buffer(const unsigned char *buffer, size_t size);
+GB_rom_image_t *GB_rom_image_retain(GB_rom_image_t *image);
+void GB_rom_image_release(GB_rom_image_t *image);
+void GB_load_rom_image(GB_gameboy_t *gb, GB_rom_image_t *image);
     
 int GB_save_battery(GB_gameboy_t *gb, const char *path);
 void GB_load_battery(GB_gameboy_t *gb, const char *path);
@@ -673,6 +754,19 @@ void GB_set_log_callback(GB_gameboy_t *gb, GB_log_callback_t callback);
 void GB_set_input_callback(GB_gameboy_t *gb, GB_input_callback_t callback);
 void GB_set_async_input_callback(GB_gameboy_t *gb, GB_input_callback_t callback);
 void GB_set_rgb_encode_callback(GB_gameboy_t *gb, GB_rgb_encode_callback_t callback);
+
+/* Converted colors are cached in a table per color correction mode and RGB encode callback, filled as colors are
+   first used. An instance creates its own table when its mode or callback change, but a single table can be shared
+   by several instances instead; GB_set_color_table also sets the instance's mode and callback to the table's.
+   Colors in a shared table are encoded by whichever instance uses them first, so the callback must not depend on
+   the instance it's called with. Each instance holds its own reference until GB_free is called, or until
+   GB_set_rgb_encode_callback is called again, which always drops the table since the callback's output may have
+   changed. Tables can't be created without a callback, GB_color_table_create returns NULL in that case. */
+GB_color_table_t *GB_color_table_create(GB_color_correction_mode_t mode, GB_rgb_encode_callback_t callback);
+GB_color_table_t *GB_color_table_retain(GB_color_table_t *table);
+void GB_color_table_release(GB_color_table_t *table);
+void GB_set_color_table(GB_gameboy_t *gb, GB_color_table_t *table);
+
 void GB_set_infrared_callback(GB_gameboy_t *gb, GB_infrared_callback_t callback);
 void GB_set_rumble_callback(GB_gameboy_t *gb, GB_rumble_callback_t callback);
 
@@ -687,9 +781,12 @@ void GB_serial_set_data_bit(GB_gameboy_t *gb, bool data);
 void GB_disconnect_serial(GB_gameboy_t *gb);
 
 #ifdef GB_INTERNAL
+void GB_set_initial_dmg_colors(GB_gameboy_t *gb, GB_rgb_encode_callback_t callback); /* Only if no callback was set */
 uint32_t GB_get_clock_rate(GB_gameboy_t *gb);
+uint32_t GB_get_unmultiplied_clock_rate(GB_gameboy_t *gb);
 #endif
 void GB_set_clock_multiplier(GB_gameboy_t *gb, double multiplier);
+void GB_set_rtc_mode(GB_gameboy_t *gb, GB_rtc_mode_t mode);
 
 size_t GB_get_screen_width(GB_gameboy_t *gb);
 size_t GB_get_screen_height(GB_gameboy_t *gb);
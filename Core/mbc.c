@@ -43,8 +43,10 @@ const GB_cartridge_t GB_cart_defs[256] = {
 
 void GB_update_mbc_mappings(GB_gameboy_t *gb)
 {
+    /* Cached code blocks are keyed by bank, but the current one might not be mapped anymore */
+    gb->current_code_block = NULL;
     switch (gb->cartridge_type->mbc_type) {
-        case GB_NO_MBC: return;
+        case GB_NO_MBC: break;
         case GB_MBC1:
             switch (gb->mbc1_wiring) {
                 case GB_STANDARD_MBC1_WIRING:
@@ -109,6 +111,7 @@ void GB_update_mbc_mappings(GB_gameboy_t *gb)
             gb->mbc_ram_bank = gb->huc3.ram_bank;
             break;
     }
+    GB_update_page_table(gb);
 }
 
 void GB_configure_cart(GB_gameboy_t *gb)
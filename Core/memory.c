@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include "gb.h"
 
@@ -59,6 +60,7 @@ void GB_trigger_oam_bug(GB_gameboy_t *gb, uint16_t address)
             for (unsigned i = 2; i < 8; i++) {
                 gb->oam[gb->accessed_oam_row + i] = gb->oam[gb->accessed_oam_row - 8 + i];
             }
+            GB_display_update_object_index(gb, 0, 40);
         }
     }
 }
@@ -80,6 +82,7 @@ void GB_trigger_oam_bug_read(GB_gameboy_t *gb, uint16_t address)
             for (unsigned i = 2; i < 8; i++) {
                 gb->oam[gb->accessed_oam_row + i] = gb->oam[gb->accessed_oam_row - 8 + i];
             }
+            GB_display_update_object_index(gb, 0, 40);
         }
     }
 }
@@ -103,6 +106,7 @@ void GB_trigger_oam_bug_read_increase(GB_gameboy_t *gb, uint16_t address)
             for (unsigned i = 0; i < 8; i++) {
                 gb->oam[gb->accessed_oam_row + i] = gb->oam[gb->accessed_oam_row - 0x10 + i] = gb->oam[gb->accessed_oam_row - 0x08 + i];
             }
+            GB_display_update_object_index(gb, 0, 40);
         }
     }
 }
@@ -123,17 +127,20 @@ static uint8_t read_rom(GB_gameboy_t *gb, uint16_t addr)
         return gb->boot_rom[addr];
     }
 
-    if (!gb->rom_size) {
+    unsigned int effective_address = ((addr & 0x3FFF) + gb->mbc_rom0_bank * 0x4000) & gb->rom_mask;
+    if (effective_address >= gb->rom_size) {
         return 0xFF;
     }
-    unsigned int effective_address = (addr & 0x3FFF) + gb->mbc_rom0_bank * 0x4000;
-    return gb->rom[effective_address & (gb->rom_size - 1)];
+    return gb->rom[effective_address];
 }
 
 static uint8_t read_mbc_rom(GB_gameboy_t *gb, uint16_t addr)
 {
-    unsigned int effective_address = (addr & 0x3FFF) + gb->mbc_rom_bank * 0x4000;
-    return gb->rom[effective_address & (gb->rom_size - 1)];
+    unsigned int effective_address = ((addr & 0x3FFF) + gb->mbc_rom_bank * 0x4000) & gb->rom_mask;
+    if (effective_address >= gb->rom_size) {
+        return 0xFF;
+    }
+    return gb->rom[effective_address];
 }
 
 static uint8_t read_vram(GB_gameboy_t *gb, uint16_t addr)
@@ -235,6 +242,7 @@ static uint8_t read_high_memory(GB_gameboy_t *gb, uint16_t addr)
                             gb->oam[(addr & 0xf8) + i] = gb->oam[0x98 + i];
                         }
                     }
+                    GB_display_update_object_index(gb, 0, 40);
                 }
             }
             return 0xff;
@@ -426,6 +434,10 @@ uint8_t GB_read_memory(GB_gameboy_t *gb, uint16_t addr)
     if (is_addr_in_dma_use(gb, addr)) {
         addr = gb->dma_current_src;
     }
+    const uint8_t *page = gb->read_pages[addr >> 8];
+    if (page) {
+        return page[addr & 0xFF];
+    }
     return read_map[addr >> 12](gb, addr);
 }
 
@@ -499,12 +511,25 @@ static void write_mbc(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
     GB_update_mbc_mappings(gb);
 }
 
+/* Keeps the line cache's view of VRAM current, addr is the offset within the bank */
+static inline void mark_vram_written(GB_gameboy_t *gb, uint16_t addr)
+{
+    if (addr < 0x1800) {
+        gb->vram_tile_data_generation++;
+    }
+    else {
+        gb->vram_map_row_generations[(addr - 0x1800) / 32]++;
+    }
+}
+
 static void write_vram(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
 {
     if (gb->vram_write_blocked) {
         //GB_log(gb, "Wrote %02x to %04x (VRAM) during mode 3\n", value, addr);
         return;
     }
+    gb->scanline_rendered = false;
+    mark_vram_written(gb, addr & 0x1FFF);
     gb->vram[(addr & 0x1FFF) + (uint16_t) gb->cgb_vram_bank * 0x2000] = value;
 }
 
@@ -532,11 +557,17 @@ static void write_mbc_ram(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
 static void write_ram(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
 {
     gb->ram[addr & 0x0FFF] = value;
+    if (gb->code_blocks) {
+        GB_cpu_invalidate_ram_code(gb, addr & 0x0FFF);
+    }
 }
 
 static void write_banked_ram(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
 {
     gb->ram[(addr & 0x0FFF) + gb->cgb_ram_bank * 0x1000] = value;
+    if (gb->code_blocks) {
+        GB_cpu_invalidate_ram_code(gb, (addr & 0x0FFF) + gb->cgb_ram_bank * 0x1000);
+    }
 }
 
 static void write_high_memory(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
@@ -558,9 +589,12 @@ static void write_high_memory(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
             return;
         }
         
+        gb->scanline_rendered = false;
+        
         if (GB_is_cgb(gb)) {
             if (addr < 0xFEA0) {
                 gb->oam[addr & 0xFF] = value;
+                GB_display_update_object_index(gb, (addr & 0xFF) / 4, 1);
             }
             switch (gb->model) {
                 /*
@@ -616,9 +650,16 @@ static void write_high_memory(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
                     gb->oam[i] = gb->oam[(addr & 0xf8) + i];
                 }
             }
+            if (gb->accessed_oam_row == 0 || gb->accessed_oam_row == 0xa0) {
+                GB_display_update_object_index(gb, 0, 40);
+            }
+            else {
+                GB_display_update_object_index(gb, (addr & 0xFF) / 4, 1);
+            }
         }
         else if (gb->accessed_oam_row == 0) {
             gb->oam[addr & 0x7] = value;
+            GB_display_update_object_index(gb, 0, 2);
         }
         return;
     }
@@ -629,15 +670,19 @@ static void write_high_memory(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
         /* Hardware registers */
         switch (addr & 0xFF) {
             case GB_IO_WX:
+            case GB_IO_WY:
                 GB_window_related_write(gb, addr & 0xFF, value);
                 break;
-            case GB_IO_IF:
             case GB_IO_SCX:
             case GB_IO_SCY:
             case GB_IO_BGP:
             case GB_IO_OBP0:
             case GB_IO_OBP1:
-            case GB_IO_WY:
+                /* Read while drawing a line, the rest of the current line must be drawn by the FIFO */
+                gb->scanline_rendered = false;
+                gb->io_registers[addr & 0xFF] = value;
+                return;
+            case GB_IO_IF:
             case GB_IO_SB:
             case GB_IO_DMG_EMULATION_INDICATION:
             case GB_IO_UNKNOWN2:
@@ -743,11 +788,15 @@ static void write_high_memory(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
 
             case GB_IO_BIOS:
                 gb->boot_rom_finished = true;
+                GB_update_page_table(gb);
                 return;
 
             case GB_IO_DMG_EMULATION:
                 if (GB_is_cgb(gb) && !gb->boot_rom_finished) {
+                    GB_display_sync_mode_3(gb);
                     gb->cgb_mode = !(value & 0xC); /* The real "contents" of this register aren't quite known yet. */
+                    gb->scanline_rendered = false;
+                    GB_display_reschedule_mode_3(gb);
                 }
                 return;
 
@@ -773,6 +822,7 @@ static void write_high_memory(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
                 if (!gb->cgb_ram_bank) {
                     gb->cgb_ram_bank++;
                 }
+                GB_update_page_table(gb);
                 return;
             case GB_IO_VBK:
                 if (!gb->cgb_mode) {
@@ -933,6 +983,8 @@ static GB_write_function_t * const write_map[] =
 
 void GB_write_memory(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
 {
+    /* A recorded idle loop assumes memory it reads doesn't change */
+    gb->idle_loop_state = GB_IDLE_LOOP_NONE;
     if (gb->n_watchpoints) {
         GB_debugger_test_write_watchpoint(gb, addr, value);
     }
@@ -940,15 +992,84 @@ void GB_write_memory(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
         /* Todo: What should happen? Will this affect DMA? Will data be written? What and where? */
         return;
     }
+    uint8_t *page = gb->write_pages[addr >> 8];
+    if (page) {
+        page[addr & 0xFF] = value;
+        return;
+    }
     write_map[addr >> 12](gb, addr, value);
 }
 
+/* Maps the pages where the read and write functions above would only access ROM, MBC RAM or WRAM at a fixed offset.
+   Must be called whenever that offset or condition changes: MBC mappings, SVBK, the boot ROM being unmapped, a reset
+   or a loaded state. Everything else, including the boot ROM, VRAM, RTC and camera registers, echo RAM above F000 and
+   the FFXX page, keeps going through the read and write maps. Cached RAM code must be invalidated on writes, so RAM
+   is only mapped for reading while the cached interpreter is enabled. */
+void GB_update_page_table(GB_gameboy_t *gb)
+{
+    /* For banks past the end of a ROM whose size isn't a power of two. Never written, ROM isn't mapped for writing */
+    static const uint8_t rom_padding_page[0x100] = {[0 ... 0xFF] = 0xFF};
+    
+    memset(gb->read_pages, 0, sizeof(gb->read_pages));
+    memset(gb->write_pages, 0, sizeof(gb->write_pages));
+    
+    if (gb->rom_size) {
+        for (unsigned page = 0; page < 0x80; page++) {
+            if (!gb->boot_rom_finished && (page == 0 || (page >= 2 && page < 9 && GB_is_cgb(gb)))) continue;
+            unsigned bank = page < 0x40? gb->mbc_rom0_bank : gb->mbc_rom_bank;
+            unsigned offset = (((page << 8) & 0x3FFF) + bank * 0x4000) & gb->rom_mask;
+            gb->read_pages[page] = offset < gb->rom_size? &gb->rom[offset] : (uint8_t *)rom_padding_page;
+        }
+    }
+    
+    if (gb->mbc_ram && gb->mbc_ram_enable && gb->mbc_ram_size >= 0x100 && !gb->camera_registers_mapped &&
+        gb->cartridge_type->mbc_type != GB_MBC2 && gb->cartridge_type->mbc_subtype != GB_CAMERA &&
+        !(gb->cartridge_type->has_rtc && gb->mbc_ram_bank >= 8 && gb->mbc_ram_bank <= 0xC)) {
+        for (unsigned page = 0xA0; page < 0xC0; page++) {
+            gb->read_pages[page] = gb->write_pages[page] =
+                &gb->mbc_ram[(((page << 8) & 0x1FFF) + gb->mbc_ram_bank * 0x2000) & (gb->mbc_ram_size - 1)];
+        }
+    }
+    
+    if (gb->ram) {
+        /* E000-EFFF mirrors C000-CFFF */
+        for (unsigned page = 0xC0; page < 0xF0; page++) {
+            unsigned bank = (page & 0x10)? gb->cgb_ram_bank : 0;
+            gb->read_pages[page] = &gb->ram[((page << 8) & 0x0FFF) + bank * 0x1000];
+            if (!gb->code_blocks) {
+                gb->write_pages[page] = gb->read_pages[page];
+            }
+        }
+    }
+}
+
 void GB_dma_run(GB_gameboy_t *gb)
 {
+    /* Sources in the page table read the same for every step, so the elapsed steps can be copied at once */
+    const uint8_t *source = NULL;
+    if (gb->dma_cycles >= 4 && gb->dma_current_src < 0xE000 && !gb->n_watchpoints) {
+        source = gb->read_pages[gb->dma_current_src >> 8];
+    }
+    if (source) {
+        unsigned count = MIN(gb->dma_cycles / 4, gb->dma_steps_left);
+        count = MIN(count, 0x100 - (gb->dma_current_src & 0xFF));
+        memcpy(&gb->oam[gb->dma_current_dest], source + (gb->dma_current_src & 0xFF), count);
+        GB_display_update_object_index(gb, gb->dma_current_dest / 4, (count + (gb->dma_current_dest & 3) + 3) / 4);
+        gb->scanline_rendered = false;
+        gb->dma_cycles -= count * 4;
+        gb->dma_steps_left -= count;
+        gb->dma_current_dest += count;
+        gb->dma_current_src += count;
+        if (!gb->dma_steps_left) {
+            gb->is_dma_restarting = false;
+        }
+    }
+    
     while (gb->dma_cycles >= 4 && gb->dma_steps_left) {
         /* Todo: measure this value */
         gb->dma_cycles -= 4;
         gb->dma_steps_left--;
+        gb->scanline_rendered = false;
         
         if (gb->dma_current_src < 0xe000) {
             gb->oam[gb->dma_current_dest++] = GB_read_memory(gb, gb->dma_current_src);
@@ -957,6 +1078,7 @@ void GB_dma_run(GB_gameboy_t *gb)
             /* Todo: Not correct on the CGB */
             gb->oam[gb->dma_current_dest++] = GB_read_memory(gb, gb->dma_current_src & ~0x2000);
         }
+        GB_display_update_object_index(gb, (gb->dma_current_dest - 1) / 4, 1);
         
         /* dma_current_src must be the correct value during GB_read_memory */
         gb->dma_current_src++;
@@ -971,9 +1093,31 @@ void GB_hdma_run(GB_gameboy_t *gb)
     if (!gb->hdma_on) return;
 
     while (gb->hdma_cycles >= 0x4) {
-        gb->hdma_cycles -= 0x4;
-
-        GB_write_memory(gb, 0x8000 | (gb->hdma_current_dest++ & 0x1FFF), GB_read_memory(gb, (gb->hdma_current_src++)));
+        const uint8_t *source = NULL;
+        if (!gb->n_watchpoints && !gb->dma_steps_left) {
+            source = gb->read_pages[gb->hdma_current_src >> 8];
+        }
+        
+        if (source) {
+            /* Copy the elapsed part of the current block at once */
+            unsigned count = MIN(gb->hdma_cycles / 4, 0x10 - (gb->hdma_current_dest & 0xF));
+            count = MIN(count, 0x100 - (gb->hdma_current_src & 0xFF));
+            if (!gb->vram_write_blocked) {
+                memcpy(&gb->vram[(gb->hdma_current_dest & 0x1FFF) + (uint16_t) gb->cgb_vram_bank * 0x2000],
+                       source + (gb->hdma_current_src & 0xFF), count);
+                gb->scanline_rendered = false;
+                /* Blocks are 16-byte aligned, so they never span more than one map row */
+                mark_vram_written(gb, gb->hdma_current_dest & 0x1FFF);
+            }
+            gb->idle_loop_state = GB_IDLE_LOOP_NONE;
+            gb->hdma_cycles -= count * 4;
+            gb->hdma_current_dest += count;
+            gb->hdma_current_src += count;
+        }
+        else {
+            gb->hdma_cycles -= 0x4;
+            GB_write_memory(gb, 0x8000 | (gb->hdma_current_dest++ & 0x1FFF), GB_read_memory(gb, (gb->hdma_current_src++)));
+        }
         
         if ((gb->hdma_current_dest & 0xf) == 0) {
             if (--gb->hdma_steps_left == 0) {
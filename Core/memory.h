@@ -10,6 +10,7 @@ void GB_dma_run(GB_gameboy_t *gb);
 void GB_hdma_run(GB_gameboy_t *gb);
 void GB_trigger_oam_bug(GB_gameboy_t *gb, uint16_t address);
 void GB_trigger_oam_bug_read_increase(GB_gameboy_t *gb, uint16_t address);
+void GB_update_page_table(GB_gameboy_t *gb);
 #endif
 
 #endif /* memory_h */
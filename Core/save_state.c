@@ -139,6 +139,76 @@ static bool read_section(FILE *f, void *dest, uint32_t size)
 }
 #undef DUMP_SECTION
 
+/* Version 13 states stored each pixel FIFO as a ring of unpacked pixels, which also moved the rest of the video
+   section. They're converted to the packed FIFOs when loaded. */
+#define GB_UNPACKED_FIFO_STRUCT_VERSION 13
+
+typedef struct {
+    struct {
+        uint8_t pixel;
+        uint8_t palette;
+        uint8_t priority;
+        bool bg_priority;
+    } fifo[16];
+    uint8_t read_end;
+    uint8_t write_end;
+} GB_unpacked_fifo_t;
+
+#define GB_FIFOS_OFFSET (offsetof(GB_gameboy_t, bg_fifo) - GB_SECTION_OFFSET(video))
+#define GB_CYCLES_FOR_LINE_OFFSET (offsetof(GB_gameboy_t, cycles_for_line) - GB_SECTION_OFFSET(video))
+/* The unpacked FIFOs are followed by fetcher_x, fetcher_y and then the rest of the section from cycles_for_line on */
+#define GB_UNPACKED_VIDEO_SECTION_SIZE (GB_FIFOS_OFFSET + 2 * sizeof(GB_unpacked_fifo_t) + 2 + \
+                                        GB_SECTION_SIZE(video) - GB_CYCLES_FOR_LINE_OFFSET)
+/* Version 13's fields from cycles_for_line on are at most 2-byte aligned, so they keep their layout if both offsets
+   of cycles_for_line are even */
+_Static_assert((GB_CYCLES_FOR_LINE_OFFSET - (GB_FIFOS_OFFSET + 2 * sizeof(GB_unpacked_fifo_t) + 2)) % 2 == 0,
+               "The unpacked video section's layout doesn't match");
+
+static void convert_unpacked_video_section(GB_gameboy_t *save, const uint8_t *section)
+{
+    memcpy(GB_GET_SECTION(save, video), section, GB_FIFOS_OFFSET);
+    
+    GB_unpacked_fifo_t fifos[2];
+    memcpy(fifos, section + GB_FIFOS_OFFSET, sizeof(fifos));
+    
+    GB_unpacked_fifo_t *bg = &fifos[0];
+    unsigned size = (bg->write_end - bg->read_end) & 0xF;
+    if (size > 8) {
+        size = 8;
+    }
+    memset(&save->bg_fifo, 0, sizeof(save->bg_fifo));
+    save->bg_fifo.size = size;
+    /* A BG row is only pushed to an empty FIFO, so all of its pixels share their attributes */
+    save->bg_fifo.palette = bg->fifo[bg->read_end & 0xF].palette;
+    save->bg_fifo.bg_priority = bg->fifo[bg->read_end & 0xF].bg_priority;
+    for (unsigned i = 0; i < size; i++) {
+        uint8_t pixel = bg->fifo[(bg->read_end + i) & 0xF].pixel;
+        save->bg_fifo.lower |= (pixel & 1) << (7 - i);
+        save->bg_fifo.upper |= ((pixel >> 1) & 1) << (7 - i);
+    }
+    
+    GB_unpacked_fifo_t *oam = &fifos[1];
+    size = (oam->write_end - oam->read_end) & 0xF;
+    if (size > 8) {
+        size = 8;
+    }
+    memset(&save->oam_fifo, 0, sizeof(save->oam_fifo));
+    for (unsigned i = 0; i < size; i++) {
+        typeof(oam->fifo[0]) *item = &oam->fifo[(oam->read_end + i) & 0xF];
+        save->oam_fifo.lower |= (item->pixel & 1) << (7 - i);
+        save->oam_fifo.upper |= ((item->pixel >> 1) & 1) << (7 - i);
+        save->oam_fifo.bg_priority |= item->bg_priority << (7 - i);
+        save->oam_fifo.palette[i] = item->palette;
+        save->oam_fifo.priority[i] = item->priority;
+    }
+    
+    const uint8_t *tail = section + GB_FIFOS_OFFSET + sizeof(fifos);
+    save->fetcher_x = tail[0];
+    save->fetcher_y = tail[1];
+    memcpy(&save->cycles_for_line, tail + 2, GB_SECTION_SIZE(video) - GB_CYCLES_FOR_LINE_OFFSET);
+    save->version = GB_STRUCT_VERSION;
+}
+
 static bool verify_state_compatibility(GB_gameboy_t *gb, GB_gameboy_t *save)
 {
     if (gb->magic != save->magic) {
@@ -180,6 +250,9 @@ int GB_load_state(GB_gameboy_t *gb, const char *path)
 {
     GB_gameboy_t save;
     
+    /* Cached code might not match the loaded state */
+    GB_cpu_flush_code_blocks(gb);
+    
     /* Every unread value should be kept the same. */
     memcpy(&save, gb, sizeof(save));
     
@@ -197,7 +270,13 @@ int GB_load_state(GB_gameboy_t *gb, const char *path)
     if (!READ_SECTION(&save, f, timing    )) goto error;
     if (!READ_SECTION(&save, f, apu       )) goto error;
     if (!READ_SECTION(&save, f, rtc       )) goto error;
-    if (!READ_SECTION(&save, f, video     )) goto error;
+    if (save.version == GB_UNPACKED_FIFO_STRUCT_VERSION) {
+        /* Fields missing from older states are zero, which leaves the FIFOs in charge of mode 3 timing */
+        uint8_t video[GB_UNPACKED_VIDEO_SECTION_SIZE] = {0,};
+        if (!read_section(f, video, sizeof(video))) goto error;
+        convert_unpacked_video_section(&save, video);
+    }
+    else if (!READ_SECTION(&save, f, video     )) goto error;
     
     if (!verify_state_compatibility(gb, &save)) {
         errno = -1;
@@ -225,6 +304,7 @@ int GB_load_state(GB_gameboy_t *gb, const char *path)
     }
     
     memcpy(gb, &save, sizeof(save));
+    GB_update_page_table(gb);
     errno = 0;
     
     if (gb->cartridge_type->has_rumble && gb->rumble_callback) {
@@ -235,11 +315,13 @@ int GB_load_state(GB_gameboy_t *gb, const char *path)
         GB_palette_changed(gb, false, i * 2);
         GB_palette_changed(gb, true, i * 2);
     }
+    GB_display_invalidate_line_cache(gb);
+    GB_display_update_object_index(gb, 0, 40);
 
-    gb->bg_fifo.read_end &= 0xF;
-    gb->bg_fifo.write_end &= 0xF;
-    gb->oam_fifo.read_end &= 0xF;
-    gb->oam_fifo.write_end &= 0xF;
+    if (gb->bg_fifo.size > 8) {
+        gb->bg_fifo.size = 8;
+    }
+    gb->oam_fifo.read_end &= 7;
     
 error:
     fclose(f);
@@ -290,6 +372,9 @@ int GB_load_state_from_buffer(GB_gameboy_t *gb, const uint8_t *buffer, size_t le
 {
     GB_gameboy_t save;
     
+    /* Cached code might not match the loaded state */
+    GB_cpu_flush_code_blocks(gb);
+    
     /* Every unread value should be kept the same. */
     memcpy(&save, gb, sizeof(save));
     
@@ -301,7 +386,13 @@ int GB_load_state_from_buffer(GB_gameboy_t *gb, const uint8_t *buffer, size_t le
     if (!READ_SECTION(&save, buffer, length, timing    )) return -1;
     if (!READ_SECTION(&save, buffer, length, apu       )) return -1;
     if (!READ_SECTION(&save, buffer, length, rtc       )) return -1;
-    if (!READ_SECTION(&save, buffer, length, video     )) return -1;
+    if (save.version == GB_UNPACKED_FIFO_STRUCT_VERSION) {
+        /* Fields missing from older states are zero, which leaves the FIFOs in charge of mode 3 timing */
+        uint8_t video[GB_UNPACKED_VIDEO_SECTION_SIZE] = {0,};
+        if (!buffer_read_section(&buffer, &length, video, sizeof(video))) return -1;
+        convert_unpacked_video_section(&save, video);
+    }
+    else if (!READ_SECTION(&save, buffer, length, video     )) return -1;
     
     if (!verify_state_compatibility(gb, &save)) {
         return -1;
@@ -325,6 +416,7 @@ int GB_load_state_from_buffer(GB_gameboy_t *gb, const uint8_t *buffer, size_t le
     }
     
     memcpy(gb, &save, sizeof(save));
+    GB_update_page_table(gb);
     
     if (gb->cartridge_type->has_rumble && gb->rumble_callback) {
         gb->rumble_callback(gb, gb->rumble_state);
@@ -334,11 +426,13 @@ int GB_load_state_from_buffer(GB_gameboy_t *gb, const uint8_t *buffer, size_t le
         GB_palette_changed(gb, false, i * 2);
         GB_palette_changed(gb, true, i * 2);
     }
+    GB_display_invalidate_line_cache(gb);
+    GB_display_update_object_index(gb, 0, 40);
     
-    gb->bg_fifo.read_end &= 0xF;
-    gb->bg_fifo.write_end &= 0xF;
-    gb->oam_fifo.read_end &= 0xF;
-    gb->oam_fifo.write_end &= 0xF;
+    if (gb->bg_fifo.size > 8) {
+        gb->bg_fifo.size = 8;
+    }
+    gb->oam_fifo.read_end &= 7;
     
     return 0;
 }
@@ -51,24 +51,134 @@ static const GB_conflict_t dmg_conflict_map[0x80] = {
     [GB_IO_SCX] = GB_CONFLICT_READ_NEW,
 };
 
+/* Idle loop detection:
+   Games often wait in short loops that only poll memory, e.g. for LY to reach a line, for a STAT mode or for a flag
+   set by an interrupt handler. After a short backward jump, one iteration of the loop is recorded access by access.
+   If the iteration writes nothing, only reads ROM, WRAM, HRAM and IF, STAT or LY (loaded into A), and ends in the
+   state it started in, the loop is idle: further iterations are replayed by advancing the other units exactly like
+   the recorded iteration did, reading only the polled registers. While the polled registers can't change (see
+   GB_skippable_polling_cycles), whole iterations are skipped with a single GB_advance_cycles call. Replaying stops
+   at the first instruction boundary where an interrupt could be dispatched, a frame ends, HDMA starts, or GB_run's
+   8-bit cycle count could overflow, and as soon as a polled register returns a different value, the CPU resumes
+   right after that read. Any write to memory drops the recording, and since memory can also be modified without
+   the emulated bus (e.g. through GB_get_direct_access), the recorded ROM, WRAM and HRAM reads are read again
+   whenever replaying starts. Timing is identical to running the loop instruction by instruction; the debugger's
+   ticks command reports how many cycles were replayed. */
+
+#define GB_IDLE_LOOP_MAX_LENGTH 0x20
+#define GB_IDLE_LOOP_MAX_INSTRUCTIONS 8
+#define GB_IDLE_LOOP_MAX_ACCESSES 24
+#define GB_IDLE_LOOP_MAX_ATTEMPTS 3
+
+struct GB_idle_loop_s {
+    uint16_t rejected_address; // Last loop that can't be replayed, not recorded again until another loop is
+    uint8_t attempts;
+    unsigned long start_ticks;
+    uint8_t n_instructions;
+    uint8_t n_accesses;
+    unsigned cycles; // Of a whole iteration
+    struct {
+        uint16_t registers[GB_REGISTERS_16_BIT];
+        uint16_t pc;
+        bool ime;
+        uint8_t opcode;
+        uint8_t first_access;
+        uint8_t end_cycles; // Pending cycles flushed at the end of the instruction
+        uint8_t cycles;
+    } instructions[GB_IDLE_LOOP_MAX_INSTRUCTIONS];
+    struct {
+        uint16_t address;
+        uint8_t value;
+        uint8_t cycles; // Pending cycles advanced before the access
+        bool polled; // Otherwise, the value can't change without a write
+    } accesses[GB_IDLE_LOOP_MAX_ACCESSES];
+};
+
+static void reject_idle_loop(GB_gameboy_t *gb)
+{
+    gb->idle_loop->rejected_address = gb->idle_loop_address;
+    gb->idle_loop_state = GB_IDLE_LOOP_NONE;
+}
+
+static void idle_loop_record_read(GB_gameboy_t *gb, uint16_t addr, uint8_t value, uint8_t cycles)
+{
+    struct GB_idle_loop_s *loop = gb->idle_loop;
+    if (gb->dma_steps_left) {
+        gb->idle_loop_state = GB_IDLE_LOOP_NONE;
+        return;
+    }
+    if (loop->n_accesses == GB_IDLE_LOOP_MAX_ACCESSES) {
+        reject_idle_loop(gb);
+        return;
+    }
+    
+    typeof(loop->instructions[0]) *instruction = &loop->instructions[loop->n_instructions - 1];
+    bool opcode_fetch = loop->n_accesses == instruction->first_access;
+    bool polled = false;
+    if (addr >= 0xFF00 && addr < 0xFF80) {
+        if (opcode_fetch) {
+            reject_idle_loop(gb);
+            return;
+        }
+        switch (addr & 0x7F) {
+            case GB_IO_IF:
+            case GB_IO_STAT:
+            case GB_IO_LY:
+                break;
+            default:
+                reject_idle_loop(gb);
+                return;
+        }
+        switch (instruction->opcode) {
+            case 0x0A: case 0x1A: case 0x7E: case 0xF0: case 0xF2: case 0xFA:
+                break;
+            default:
+                reject_idle_loop(gb);
+                return;
+        }
+        polled = true;
+    }
+    else if ((addr >= 0x8000 && addr < 0xC000) || (addr >= 0xFE00 && addr < 0xFF00)) {
+        reject_idle_loop(gb);
+        return;
+    }
+    
+    if (opcode_fetch) {
+        instruction->opcode = value;
+    }
+    loop->accesses[loop->n_accesses].address = addr;
+    loop->accesses[loop->n_accesses].value = value;
+    loop->accesses[loop->n_accesses].cycles = cycles;
+    loop->accesses[loop->n_accesses].polled = polled;
+    loop->n_accesses++;
+}
+
 static uint8_t cycle_read(GB_gameboy_t *gb, uint16_t addr)
 {
+    uint8_t cycles = gb->pending_cycles;
     if (gb->pending_cycles) {
         GB_advance_cycles(gb, gb->pending_cycles);
     }
     uint8_t ret = GB_read_memory(gb, addr);
     gb->pending_cycles = 4;
+    if (gb->idle_loop_state == GB_IDLE_LOOP_RECORDING) {
+        idle_loop_record_read(gb, addr, ret, cycles);
+    }
     return ret;
 }
 
 static uint8_t cycle_read_inc_oam_bug(GB_gameboy_t *gb, uint16_t addr)
 {
+    uint8_t cycles = gb->pending_cycles;
     if (gb->pending_cycles) {
         GB_advance_cycles(gb, gb->pending_cycles);
     }
     GB_trigger_oam_bug_read_increase(gb, addr); /* Todo: test T-cycle timing */
     uint8_t ret = GB_read_memory(gb, addr);
     gb->pending_cycles = 4;
+    if (gb->idle_loop_state == GB_IDLE_LOOP_RECORDING) {
+        idle_loop_record_read(gb, addr, ret, cycles);
+    }
     return ret;
 }
 
@@ -80,6 +190,10 @@ static uint8_t cycle_read_inc_oam_bug(GB_gameboy_t *gb, uint16_t addr)
 static uint8_t cycle_write_if(GB_gameboy_t *gb, uint8_t value)
 {
     assert(gb->pending_cycles);
+    gb->current_code_block = NULL;
+    if (gb->idle_loop_state == GB_IDLE_LOOP_RECORDING) {
+        reject_idle_loop(gb);
+    }
     GB_advance_cycles(gb, gb->pending_cycles);
     uint8_t old = (gb->io_registers[GB_IO_IF]) & 0x1F;
     GB_write_memory(gb, 0xFF00 + GB_IO_IF, value);
@@ -90,6 +204,11 @@ static uint8_t cycle_write_if(GB_gameboy_t *gb, uint8_t value)
 static void cycle_write(GB_gameboy_t *gb, uint16_t addr, uint8_t value)
 {
     assert(gb->pending_cycles);
+    /* Writes may switch banks, modify code, start an OAM DMA, etc. */
+    gb->current_code_block = NULL;
+    if (gb->idle_loop_state == GB_IDLE_LOOP_RECORDING) {
+        reject_idle_loop(gb);
+    }
     GB_conflict_t conflict = GB_CONFLICT_READ_OLD;
     if ((addr & 0xFF80) == 0xFF00) {
         conflict = (GB_is_cgb(gb)? cgb_conflict_map : dmg_conflict_map)[addr & 0x7F];
@@ -195,6 +314,40 @@ static void flush_pending_cycles(GB_gameboy_t *gb)
     gb->pending_cycles = 0;
 }
 
+/* Cached interpreter:
+   Straight-line runs of code in ROM and WRAM are predecoded into blocks keyed by address and bank, so instruction
+   fetches inside a block skip the memory bus. Fetches are still timed exactly like regular reads. A block is only
+   used while it's guaranteed to match what the bus would return; any CPU write drops the current block, as it might
+   switch banks, modify code or start an OAM DMA. */
+
+#define GB_CODE_BLOCK_COUNT 0x1000
+#define GB_CODE_BLOCK_MAX_LENGTH 0x20
+
+struct GB_code_block_s {
+    uint16_t address;
+    uint16_t bank;
+    uint8_t length; // 0 if unused
+    uint8_t code[GB_CODE_BLOCK_MAX_LENGTH];
+};
+
+static uint8_t cycle_fetch(GB_gameboy_t *gb, uint16_t addr)
+{
+    GB_code_block_t *block = gb->current_code_block;
+    if (block && (uint16_t)(addr - block->address) < block->length) {
+        uint8_t cycles = gb->pending_cycles;
+        if (gb->pending_cycles) {
+            GB_advance_cycles(gb, gb->pending_cycles);
+        }
+        gb->pending_cycles = 4;
+        uint8_t value = block->code[addr - block->address];
+        if (gb->idle_loop_state == GB_IDLE_LOOP_RECORDING) {
+            idle_loop_record_read(gb, addr, value, cycles);
+        }
+        return value;
+    }
+    return cycle_read_inc_oam_bug(gb, addr);
+}
+
 /* Todo: test if multi-byte opcodes trigger the OAM bug correctly */
 
 static void ill(GB_gameboy_t *gb, uint8_t opcode)
@@ -257,8 +410,8 @@ static void ld_rr_d16(GB_gameboy_t *gb, uint8_t opcode)
     uint8_t register_id;
     uint16_t value;
     register_id = (opcode >> 4) + 1;
-    value = cycle_read_inc_oam_bug(gb, gb->pc++);
-    value |= cycle_read_inc_oam_bug(gb, gb->pc++) << 8;
+    value = cycle_fetch(gb, gb->pc++);
+    value |= cycle_fetch(gb, gb->pc++) << 8;
     gb->registers[register_id] = value;
 }
 
@@ -313,7 +466,7 @@ static void ld_hr_d8(GB_gameboy_t *gb, uint8_t opcode)
     uint8_t register_id;
     register_id = ((opcode >> 4) + 1) & 0x03;
     gb->registers[register_id] &= 0xFF;
-    gb->registers[register_id] |= cycle_read_inc_oam_bug(gb, gb->pc++) << 8;
+    gb->registers[register_id] |= cycle_fetch(gb, gb->pc++) << 8;
 }
 
 static void rlca(GB_gameboy_t *gb, uint8_t opcode)
@@ -344,8 +497,8 @@ static void ld_da16_sp(GB_gameboy_t *gb, uint8_t opcode)
 {
     /* Todo: Verify order is correct */
     uint16_t addr;
-    addr = cycle_read_inc_oam_bug(gb, gb->pc++);
-    addr |= cycle_read_inc_oam_bug(gb, gb->pc++) << 8;
+    addr = cycle_fetch(gb, gb->pc++);
+    addr |= cycle_fetch(gb, gb->pc++) << 8;
     cycle_write(gb, addr, gb->registers[GB_REGISTER_SP] & 0xFF);
     cycle_write(gb, addr+1, gb->registers[GB_REGISTER_SP] >> 8);
 }
@@ -431,7 +584,7 @@ static void ld_lr_d8(GB_gameboy_t *gb, uint8_t opcode)
     uint8_t register_id;
     register_id = (opcode >> 4) + 1;
     gb->registers[register_id] &= 0xFF00;
-    gb->registers[register_id] |= cycle_read_inc_oam_bug(gb, gb->pc++);
+    gb->registers[register_id] |= cycle_fetch(gb, gb->pc++);
 }
 
 static void rrca(GB_gameboy_t *gb, uint8_t opcode)
@@ -461,7 +614,7 @@ static void rra(GB_gameboy_t *gb, uint8_t opcode)
 static void jr_r8(GB_gameboy_t *gb, uint8_t opcode)
 {
     /* Todo: Verify timing */
-    gb->pc += (int8_t)cycle_read_inc_oam_bug(gb, gb->pc) + 1;
+    gb->pc += (int8_t)cycle_fetch(gb, gb->pc) + 1;
     cycle_no_access(gb);
 }
 
@@ -483,7 +636,7 @@ static bool condition_code(GB_gameboy_t *gb, uint8_t opcode)
 
 static void jr_cc_r8(GB_gameboy_t *gb, uint8_t opcode)
 {
-    int8_t offset = cycle_read_inc_oam_bug(gb, gb->pc++);
+    int8_t offset = cycle_fetch(gb, gb->pc++);
     if (condition_code(gb, opcode)) {
         gb->pc += offset;
         cycle_no_access(gb);
@@ -602,7 +755,7 @@ static void dec_dhl(GB_gameboy_t *gb, uint8_t opcode)
 
 static void ld_dhl_d8(GB_gameboy_t *gb, uint8_t opcode)
 {
-    uint8_t data = cycle_read_inc_oam_bug(gb, gb->pc++);
+    uint8_t data = cycle_fetch(gb, gb->pc++);
     cycle_write(gb, gb->registers[GB_REGISTER_HL], data);
 }
 
@@ -843,8 +996,8 @@ static void pop_rr(GB_gameboy_t *gb, uint8_t opcode)
 
 static void jp_cc_a16(GB_gameboy_t *gb, uint8_t opcode)
 {
-    uint16_t addr = cycle_read_inc_oam_bug(gb, gb->pc++);
-    addr |= (cycle_read_inc_oam_bug(gb, gb->pc++) << 8);
+    uint16_t addr = cycle_fetch(gb, gb->pc++);
+    addr |= (cycle_fetch(gb, gb->pc++) << 8);
     if (condition_code(gb, opcode)) {
         cycle_no_access(gb);
         gb->pc = addr;
@@ -853,8 +1006,8 @@ static void jp_cc_a16(GB_gameboy_t *gb, uint8_t opcode)
 
 static void jp_a16(GB_gameboy_t *gb, uint8_t opcode)
 {
-    uint16_t addr = cycle_read_inc_oam_bug(gb, gb->pc);
-    addr |= (cycle_read_inc_oam_bug(gb, gb->pc + 1) << 8);
+    uint16_t addr = cycle_fetch(gb, gb->pc);
+    addr |= (cycle_fetch(gb, gb->pc + 1) << 8);
     cycle_no_access(gb);
     gb->pc = addr;
     
@@ -863,8 +1016,8 @@ static void jp_a16(GB_gameboy_t *gb, uint8_t opcode)
 static void call_cc_a16(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint16_t call_addr = gb->pc - 1;
-    uint16_t addr = cycle_read_inc_oam_bug(gb, gb->pc++);
-    addr |= (cycle_read_inc_oam_bug(gb, gb->pc++) << 8);
+    uint16_t addr = cycle_fetch(gb, gb->pc++);
+    addr |= (cycle_fetch(gb, gb->pc++) << 8);
     if (condition_code(gb, opcode)) {
         cycle_oam_bug(gb, GB_REGISTER_SP);
         cycle_write(gb, --gb->registers[GB_REGISTER_SP], (gb->pc) >> 8);
@@ -887,7 +1040,7 @@ static void push_rr(GB_gameboy_t *gb, uint8_t opcode)
 static void add_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint8_t value, a;
-    value = cycle_read_inc_oam_bug(gb, gb->pc++);
+    value = cycle_fetch(gb, gb->pc++);
     a = gb->registers[GB_REGISTER_AF] >> 8;
     gb->registers[GB_REGISTER_AF] = (a + value) << 8;
     if ((uint8_t) (a + value) == 0) {
@@ -904,7 +1057,7 @@ static void add_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 static void adc_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint8_t value, a, carry;
-    value = cycle_read_inc_oam_bug(gb, gb->pc++);
+    value = cycle_fetch(gb, gb->pc++);
     a = gb->registers[GB_REGISTER_AF] >> 8;
     carry = (gb->registers[GB_REGISTER_AF] & GB_CARRY_FLAG) != 0;
     gb->registers[GB_REGISTER_AF] = (a + value + carry) << 8;
@@ -923,7 +1076,7 @@ static void adc_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 static void sub_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint8_t value, a;
-    value = cycle_read_inc_oam_bug(gb, gb->pc++);
+    value = cycle_fetch(gb, gb->pc++);
     a = gb->registers[GB_REGISTER_AF] >> 8;
     gb->registers[GB_REGISTER_AF] = ((a - value) << 8) | GB_SUBSTRACT_FLAG;
     if (a == value) {
@@ -940,7 +1093,7 @@ static void sub_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 static void sbc_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint8_t value, a, carry;
-    value = cycle_read_inc_oam_bug(gb, gb->pc++);
+    value = cycle_fetch(gb, gb->pc++);
     a = gb->registers[GB_REGISTER_AF] >> 8;
     carry = (gb->registers[GB_REGISTER_AF] & GB_CARRY_FLAG) != 0;
     gb->registers[GB_REGISTER_AF] = ((a - value - carry) << 8) | GB_SUBSTRACT_FLAG;
@@ -959,7 +1112,7 @@ static void sbc_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 static void and_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint8_t value, a;
-    value = cycle_read_inc_oam_bug(gb, gb->pc++);
+    value = cycle_fetch(gb, gb->pc++);
     a = gb->registers[GB_REGISTER_AF] >> 8;
     gb->registers[GB_REGISTER_AF] = ((a & value) << 8) | GB_HALF_CARRY_FLAG;
     if ((a & value) == 0) {
@@ -970,7 +1123,7 @@ static void and_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 static void xor_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint8_t value, a;
-    value = cycle_read_inc_oam_bug(gb, gb->pc++);
+    value = cycle_fetch(gb, gb->pc++);
     a = gb->registers[GB_REGISTER_AF] >> 8;
     gb->registers[GB_REGISTER_AF] = (a ^ value) << 8;
     if ((a ^ value) == 0) {
@@ -981,7 +1134,7 @@ static void xor_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 static void or_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint8_t value, a;
-    value = cycle_read_inc_oam_bug(gb, gb->pc++);
+    value = cycle_fetch(gb, gb->pc++);
     a = gb->registers[GB_REGISTER_AF] >> 8;
     gb->registers[GB_REGISTER_AF] = (a | value) << 8;
     if ((a | value) == 0) {
@@ -992,7 +1145,7 @@ static void or_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 static void cp_a_d8(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint8_t value, a;
-    value = cycle_read_inc_oam_bug(gb, gb->pc++);
+    value = cycle_fetch(gb, gb->pc++);
     a = gb->registers[GB_REGISTER_AF] >> 8;
     gb->registers[GB_REGISTER_AF] &= 0xFF00;
     gb->registers[GB_REGISTER_AF] |= GB_SUBSTRACT_FLAG;
@@ -1045,8 +1198,8 @@ static void ret_cc(GB_gameboy_t *gb, uint8_t opcode)
 static void call_a16(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint16_t call_addr = gb->pc - 1;
-    uint16_t addr = cycle_read_inc_oam_bug(gb, gb->pc++);
-    addr |= (cycle_read_inc_oam_bug(gb, gb->pc++) << 8);
+    uint16_t addr = cycle_fetch(gb, gb->pc++);
+    addr |= (cycle_fetch(gb, gb->pc++) << 8);
     cycle_oam_bug(gb, GB_REGISTER_SP);
     cycle_write(gb, --gb->registers[GB_REGISTER_SP], (gb->pc) >> 8);
     cycle_write(gb, --gb->registers[GB_REGISTER_SP], (gb->pc) & 0xFF);
@@ -1056,14 +1209,14 @@ static void call_a16(GB_gameboy_t *gb, uint8_t opcode)
 
 static void ld_da8_a(GB_gameboy_t *gb, uint8_t opcode)
 {
-    uint8_t temp = cycle_read_inc_oam_bug(gb, gb->pc++);
+    uint8_t temp = cycle_fetch(gb, gb->pc++);
     cycle_write(gb, 0xFF00 + temp, gb->registers[GB_REGISTER_AF] >> 8);
 }
 
 static void ld_a_da8(GB_gameboy_t *gb, uint8_t opcode)
 {
     gb->registers[GB_REGISTER_AF] &= 0xFF;
-    uint8_t temp = cycle_read_inc_oam_bug(gb, gb->pc++);
+    uint8_t temp = cycle_fetch(gb, gb->pc++);
     gb->registers[GB_REGISTER_AF] |= cycle_read(gb, 0xFF00 + temp) << 8;
 }
 
@@ -1082,7 +1235,7 @@ static void add_sp_r8(GB_gameboy_t *gb, uint8_t opcode)
 {
     int16_t offset;
     uint16_t sp = gb->registers[GB_REGISTER_SP];
-    offset = (int8_t) cycle_read_inc_oam_bug(gb, gb->pc++);
+    offset = (int8_t) cycle_fetch(gb, gb->pc++);
     cycle_no_access(gb);
     cycle_no_access(gb);
     gb->registers[GB_REGISTER_SP] += offset;
@@ -1107,8 +1260,8 @@ static void jp_hl(GB_gameboy_t *gb, uint8_t opcode)
 static void ld_da16_a(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint16_t addr;
-    addr = cycle_read_inc_oam_bug(gb, gb->pc++);
-    addr |= cycle_read_inc_oam_bug(gb, gb->pc++) << 8;
+    addr = cycle_fetch(gb, gb->pc++);
+    addr |= cycle_fetch(gb, gb->pc++) << 8;
     cycle_write(gb, addr, gb->registers[GB_REGISTER_AF] >> 8);
 }
 
@@ -1116,8 +1269,8 @@ static void ld_a_da16(GB_gameboy_t *gb, uint8_t opcode)
 {
     uint16_t addr;
     gb->registers[GB_REGISTER_AF] &= 0xFF;
-    addr = cycle_read_inc_oam_bug(gb, gb->pc++);
-    addr |= cycle_read_inc_oam_bug(gb, gb->pc++) << 8 ;
+    addr = cycle_fetch(gb, gb->pc++);
+    addr |= cycle_fetch(gb, gb->pc++) << 8 ;
     gb->registers[GB_REGISTER_AF] |= cycle_read(gb, addr) << 8;
 }
 
@@ -1140,7 +1293,7 @@ static void ld_hl_sp_r8(GB_gameboy_t *gb, uint8_t opcode)
 {
     int16_t offset;
     gb->registers[GB_REGISTER_AF] &= 0xFF00;
-    offset = (int8_t) cycle_read_inc_oam_bug(gb, gb->pc++);
+    offset = (int8_t) cycle_fetch(gb, gb->pc++);
     cycle_no_access(gb);
     gb->registers[GB_REGISTER_HL] = gb->registers[GB_REGISTER_SP] + offset;
 
@@ -1312,9 +1465,36 @@ static void bit_r(GB_gameboy_t *gb, uint8_t opcode)
     }
 }
 
+#ifdef GB_THREADED_DISPATCH
+/* Threaded dispatch: GB_cpu_run has a label for every opcode (and every CB-prefixed opcode), which calls its handler
+   directly with a constant opcode so the compiler can inline and specialize it. While nothing has to be serviced
+   between instructions, each label then fetches the next opcode and jumps straight to its label, so every opcode
+   has its own indirect branch. See GB_cpu_run for when it returns instead. */
+#if !defined(__GNUC__)
+#error Threaded dispatch requires GCC or Clang
+#endif
+
+#define FOR_EACH_OPCODE_IN_ROW(X, row) \
+    X(row##0) X(row##1) X(row##2) X(row##3) X(row##4) X(row##5) X(row##6) X(row##7) \
+    X(row##8) X(row##9) X(row##A) X(row##B) X(row##C) X(row##D) X(row##E) X(row##F)
+
+#define FOR_EACH_OPCODE(X) \
+    FOR_EACH_OPCODE_IN_ROW(X, 0) FOR_EACH_OPCODE_IN_ROW(X, 1) FOR_EACH_OPCODE_IN_ROW(X, 2) FOR_EACH_OPCODE_IN_ROW(X, 3) \
+    FOR_EACH_OPCODE_IN_ROW(X, 4) FOR_EACH_OPCODE_IN_ROW(X, 5) FOR_EACH_OPCODE_IN_ROW(X, 6) FOR_EACH_OPCODE_IN_ROW(X, 7) \
+    FOR_EACH_OPCODE_IN_ROW(X, 8) FOR_EACH_OPCODE_IN_ROW(X, 9) FOR_EACH_OPCODE_IN_ROW(X, A) FOR_EACH_OPCODE_IN_ROW(X, B) \
+    FOR_EACH_OPCODE_IN_ROW(X, C) FOR_EACH_OPCODE_IN_ROW(X, D) FOR_EACH_OPCODE_IN_ROW(X, E) FOR_EACH_OPCODE_IN_ROW(X, F)
+
+static GB_opcode_t *const cb_opcodes[32] = {
+    rlc_r,      rrc_r,      rl_r,       rr_r,       sla_r,      sra_r,      swap_r,     srl_r,
+    bit_r,      bit_r,      bit_r,      bit_r,      bit_r,      bit_r,      bit_r,      bit_r,
+    bit_r,      bit_r,      bit_r,      bit_r,      bit_r,      bit_r,      bit_r,      bit_r,
+    bit_r,      bit_r,      bit_r,      bit_r,      bit_r,      bit_r,      bit_r,      bit_r,
+};
+#endif
+
 static void cb_prefix(GB_gameboy_t *gb, uint8_t opcode)
 {
-    opcode = cycle_read_inc_oam_bug(gb, gb->pc++);
+    opcode = cycle_fetch(gb, gb->pc++);
     switch (opcode >> 3) {
         case 0:
             rlc_r(gb, opcode);
@@ -1346,7 +1526,7 @@ static void cb_prefix(GB_gameboy_t *gb, uint8_t opcode)
     }
 }
 
-static GB_opcode_t *opcodes[256] = {
+static GB_opcode_t *const opcodes[256] = {
     /*  X0          X1          X2          X3          X4          X5          X6          X7                */
     /*  X8          X9          Xa          Xb          Xc          Xd          Xe          Xf                */
     nop,        ld_rr_d16,  ld_drr_a,   inc_rr,     inc_hr,     dec_hr,     ld_hr_d8,   rlca,       /* 0X */
@@ -1382,10 +1562,463 @@ static GB_opcode_t *opcodes[256] = {
     ld_a_da8,   pop_rr,     ld_a_dc,    di,         ill,        push_rr,    or_a_d8,    rst,        /* fX */
     ld_hl_sp_r8,ld_sp_hl,   ld_a_da16,  ei,         ill,        ill,        cp_a_d8,    rst,
 };
+
+#define BLOCK_END 0x80
+
+/* Instruction lengths, BLOCK_END marks instructions that end a block */
+static const uint8_t instruction_lengths[256] = {
+    /*  X0          X1          X2          X3          X4          X5          X6          X7                */
+    /*  X8          X9          Xa          Xb          Xc          Xd          Xe          Xf                */
+    1,          3,          1,          1,          1,          1,          2,          1,          /* 0X */
+    3,          1,          1,          1,          1,          1,          2,          1,
+    2|BLOCK_END,3,          1,          1,          1,          1,          2,          1,          /* 1X */
+    2|BLOCK_END,1,          1,          1,          1,          1,          2,          1,
+    2|BLOCK_END,3,          1,          1,          1,          1,          2,          1,          /* 2X */
+    2|BLOCK_END,1,          1,          1,          1,          1,          2,          1,
+    2|BLOCK_END,3,          1,          1,          1,          1,          2,          1,          /* 3X */
+    2|BLOCK_END,1,          1,          1,          1,          1,          2,          1,
+    1,          1,          1,          1,          1,          1,          1,          1,          /* 4X */
+    1,          1,          1,          1,          1,          1,          1,          1,
+    1,          1,          1,          1,          1,          1,          1,          1,          /* 5X */
+    1,          1,          1,          1,          1,          1,          1,          1,
+    1,          1,          1,          1,          1,          1,          1,          1,          /* 6X */
+    1,          1,          1,          1,          1,          1,          1,          1,
+    1,          1,          1,          1,          1,          1,          1|BLOCK_END,1,          /* 7X */
+    1,          1,          1,          1,          1,          1,          1,          1,
+    1,          1,          1,          1,          1,          1,          1,          1,          /* 8X */
+    1,          1,          1,          1,          1,          1,          1,          1,
+    1,          1,          1,          1,          1,          1,          1,          1,          /* 9X */
+    1,          1,          1,          1,          1,          1,          1,          1,
+    1,          1,          1,          1,          1,          1,          1,          1,          /* aX */
+    1,          1,          1,          1,          1,          1,          1,          1,
+    1,          1,          1,          1,          1,          1,          1,          1,          /* bX */
+    1,          1,          1,          1,          1,          1,          1,          1,
+    1|BLOCK_END,1,          3|BLOCK_END,3|BLOCK_END,3|BLOCK_END,1,          2,          1|BLOCK_END,/* cX */
+    1|BLOCK_END,1|BLOCK_END,3|BLOCK_END,2,          3|BLOCK_END,3|BLOCK_END,2,          1|BLOCK_END,
+    1|BLOCK_END,1,          3|BLOCK_END,1|BLOCK_END,3|BLOCK_END,1,          2,          1|BLOCK_END,/* dX */
+    1|BLOCK_END,1|BLOCK_END,3|BLOCK_END,1|BLOCK_END,3|BLOCK_END,1|BLOCK_END,2,          1|BLOCK_END,
+    2,          1,          1,          1|BLOCK_END,1|BLOCK_END,1,          2,          1|BLOCK_END,/* eX */
+    2,          1|BLOCK_END,3,          1|BLOCK_END,1|BLOCK_END,1|BLOCK_END,2,          1|BLOCK_END,
+    2,          1,          1,          1,          1|BLOCK_END,1,          2,          1|BLOCK_END,/* fX */
+    2,          1,          3,          1,          1|BLOCK_END,1|BLOCK_END,2,          1|BLOCK_END,
+};
+
+static inline GB_code_block_t *code_block_for(GB_gameboy_t *gb, uint16_t addr, uint16_t bank)
+{
+    return &gb->code_blocks[(addr ^ (bank * 0x9E1)) & (GB_CODE_BLOCK_COUNT - 1)];
+}
+
+/* Reads code without side effects, addr must be in ROM or WRAM */
+static uint8_t peek_code(GB_gameboy_t *gb, uint16_t addr, uint16_t bank)
+{
+    if (addr < 0x8000) {
+        unsigned offset = ((addr & 0x3FFF) + bank * 0x4000) & gb->rom_mask;
+        return offset < gb->rom_size? gb->rom[offset] : 0xFF;
+    }
+    return gb->ram[(addr & 0x0FFF) + bank * 0x1000];
+}
+
+static GB_code_block_t *find_code_block(GB_gameboy_t *gb, uint16_t addr)
+{
+    /* The boot ROM overlay, OAM DMA bus conflicts and read watchpoints all require going through the bus */
+    if (!gb->boot_rom_finished || gb->dma_steps_left || gb->n_watchpoints || !gb->rom_size) return NULL;
+    
+    uint16_t bank;
+    uint16_t region_end;
+    if (addr < 0x4000) {
+        bank = gb->mbc_rom0_bank;
+        region_end = 0x4000;
+    }
+    else if (addr < 0x8000) {
+        bank = gb->mbc_rom_bank;
+        region_end = 0x8000;
+    }
+    else if (addr >= 0xC000 && addr < 0xD000) {
+        bank = 0;
+        region_end = 0xD000;
+    }
+    else if (addr >= 0xD000 && addr < 0xE000) {
+        bank = gb->cgb_ram_bank;
+        region_end = 0xE000;
+    }
+    else {
+        return NULL;
+    }
+    
+    GB_code_block_t *block = code_block_for(gb, addr, bank);
+    if (block->length && block->address == addr && block->bank == bank) {
+        return block;
+    }
+    
+    /* Decode a new block, ending it on control flow, region boundaries or when it's full */
+    uint8_t length = 0;
+    while (true) {
+        uint8_t opcode = peek_code(gb, addr + length, bank);
+        uint8_t instruction_length = instruction_lengths[opcode] & ~BLOCK_END;
+        if (length + instruction_length > GB_CODE_BLOCK_MAX_LENGTH ||
+            addr + length + instruction_length > region_end) {
+            break;
+        }
+        for (unsigned i = 0; i < instruction_length; i++, length++) {
+            block->code[length] = peek_code(gb, addr + length, bank);
+        }
+        if (instruction_lengths[opcode] & BLOCK_END) break;
+    }
+    
+    block->address = addr;
+    block->bank = bank;
+    block->length = length;
+    if (!length) return NULL;
+    
+    if (addr >= 0xC000) {
+        /* Mark the RAM pages this block was decoded from, so writes to them invalidate it */
+        unsigned start = (addr & 0x0FFF) + bank * 0x1000;
+        for (unsigned page = start >> 8; page <= (start + length - 1) >> 8; page++) {
+            gb->code_ram_pages[page >> 3] |= 1 << (page & 7);
+        }
+    }
+    
+    return block;
+}
+
+void GB_cpu_flush_code_blocks(GB_gameboy_t *gb)
+{
+    gb->current_code_block = NULL;
+    gb->idle_loop_state = GB_IDLE_LOOP_NONE;
+    if (!gb->code_blocks) return;
+    memset(gb->code_blocks, 0, sizeof(gb->code_blocks[0]) * GB_CODE_BLOCK_COUNT);
+    memset(gb->code_ram_pages, 0, sizeof(gb->code_ram_pages));
+}
+
+void GB_cpu_invalidate_ram_code(GB_gameboy_t *gb, uint16_t offset)
+{
+    unsigned page = offset >> 8;
+    if (!(gb->code_ram_pages[page >> 3] & (1 << (page & 7)))) return;
+    
+    gb->current_code_block = NULL;
+    uint16_t bank = offset >> 12;
+    uint16_t region_start = bank? 0xD000 : 0xC000;
+    uint16_t written = region_start | (offset & 0x0FFF);
+    /* Any block starting up to GB_CODE_BLOCK_MAX_LENGTH bytes earlier might contain the written byte */
+    for (uint16_t addr = written; addr + GB_CODE_BLOCK_MAX_LENGTH > written && addr >= region_start; addr--) {
+        GB_code_block_t *block = code_block_for(gb, addr, bank);
+        if (block->length && block->address == addr && block->bank == bank && addr + block->length > written) {
+            block->length = 0;
+        }
+    }
+}
+
+void GB_set_cached_interpreter_enabled(GB_gameboy_t *gb, bool enabled)
+{
+    if (enabled == !!gb->code_blocks) return;
+    gb->current_code_block = NULL;
+    memset(gb->code_ram_pages, 0, sizeof(gb->code_ram_pages));
+    if (enabled) {
+        gb->code_blocks = calloc(GB_CODE_BLOCK_COUNT, sizeof(gb->code_blocks[0]));
+    }
+    else {
+        free(gb->code_blocks);
+        gb->code_blocks = NULL;
+    }
+    /* RAM pages can only be written directly while there's no cached code to invalidate */
+    GB_update_page_table(gb);
+}
+
+void GB_set_idle_loop_detection(GB_gameboy_t *gb, bool enabled)
+{
+    gb->idle_loop_detection = enabled;
+    gb->idle_loop_state = GB_IDLE_LOOP_NONE;
+    if (!enabled) {
+        free(gb->idle_loop);
+        gb->idle_loop = NULL;
+    }
+}
+
+void GB_set_instruction_counting(GB_gameboy_t *gb, bool enabled)
+{
+    gb->counting_instructions = enabled;
+    if (enabled) {
+        gb->instruction_count = 0;
+    }
+}
+
+uint64_t GB_get_instruction_count(GB_gameboy_t *gb)
+{
+    return gb->instruction_count;
+}
+
+static void idle_loop_record_instruction(GB_gameboy_t *gb)
+{
+    struct GB_idle_loop_s *loop = gb->idle_loop;
+    if (loop->n_instructions == GB_IDLE_LOOP_MAX_INSTRUCTIONS) {
+        reject_idle_loop(gb);
+        return;
+    }
+    typeof(loop->instructions[0]) *instruction = &loop->instructions[loop->n_instructions++];
+    memcpy(instruction->registers, gb->registers, sizeof(gb->registers));
+    instruction->pc = gb->pc;
+    instruction->ime = gb->ime;
+    instruction->first_access = loop->n_accesses;
+}
+
+/* Called before flushing the pending cycles of a recorded instruction */
+static void idle_loop_record_end(GB_gameboy_t *gb)
+{
+    if (gb->hdma_on) {
+        gb->idle_loop_state = GB_IDLE_LOOP_NONE;
+        return;
+    }
+    if (gb->halted || gb->stopped || gb->ime_toggle) {
+        reject_idle_loop(gb);
+        return;
+    }
+    struct GB_idle_loop_s *loop = gb->idle_loop;
+    typeof(loop->instructions[0]) *instruction = &loop->instructions[loop->n_instructions - 1];
+    unsigned cycles = gb->pending_cycles;
+    for (unsigned i = instruction->first_access; i < loop->n_accesses; i++) {
+        cycles += loop->accesses[i].cycles;
+    }
+    instruction->end_cycles = gb->pending_cycles;
+    instruction->cycles = cycles;
+}
+
+static void idle_loop_backward_jump(GB_gameboy_t *gb)
+{
+    if (gb->idle_loop_state != GB_IDLE_LOOP_NONE && gb->idle_loop_address == gb->pc) return;
+    if (!gb->idle_loop) {
+        gb->idle_loop = malloc(sizeof(*gb->idle_loop));
+        if (!gb->idle_loop) return;
+        gb->idle_loop->rejected_address = 0;
+    }
+    if (gb->idle_loop->rejected_address == gb->pc) return;
+    gb->idle_loop_address = gb->pc;
+    gb->idle_loop->attempts = 0;
+    gb->idle_loop_state = GB_IDLE_LOOP_ARMED;
+}
+
+/* Reading the recorded addresses has no side effects, replays never run with watchpoints or during OAM DMA */
+static bool idle_loop_values_match(GB_gameboy_t *gb, bool polled)
+{
+    struct GB_idle_loop_s *loop = gb->idle_loop;
+    for (unsigned i = 0; i < loop->n_accesses; i++) {
+        if (loop->accesses[i].polled == polled &&
+            GB_read_memory(gb, loop->accesses[i].address) != loop->accesses[i].value) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Replays the recorded iteration starting at the loop address, returns false if nothing could be replayed */
+static bool idle_loop_replay(GB_gameboy_t *gb)
+{
+    struct GB_idle_loop_s *loop = gb->idle_loop;
+    if (gb->ime_toggle || gb->halt_bug || gb->dma_steps_left) return false;
+    if (gb->n_breakpoints || gb->n_watchpoints || gb->debug_stopped ||
+        gb->debug_next_command || gb->debug_fin_command) return false;
+    if (memcmp(gb->registers, loop->instructions[0].registers, sizeof(gb->registers)) ||
+        gb->ime != loop->instructions[0].ime || !idle_loop_values_match(gb, false)) {
+        /* Not in the recorded state anymore, record it again */
+        gb->idle_loop_state = GB_IDLE_LOOP_ARMED;
+        gb->idle_loop->attempts = 0;
+        return false;
+    }
+    
+    uint8_t speed_shift = !gb->cgb_double_speed;
+    unsigned replayed_cycles = 0;
+    uint64_t replayed_instructions = 0;
+    unsigned i = 0;
+    while (true) {
+        typeof(loop->instructions[0]) *instruction = &loop->instructions[i];
+        if (gb->cycles_since_run + (instruction->cycles << speed_shift) > 0xFF) break;
+        if (replayed_cycles) {
+            if (gb->idle_loop_state != GB_IDLE_LOOP_ACTIVE || gb->vblank_just_occured || gb->hdma_starting) break;
+            if (instruction->ime && (gb->interrupt_enable & gb->io_registers[GB_IO_IF] & 0x1F)) break;
+        }
+        
+        /* Skip whole iterations while the polled registers keep the recorded values */
+        if (i == 0 && idle_loop_values_match(gb, true)) {
+            unsigned iterations = GB_skippable_polling_cycles(gb) / loop->cycles;
+            if (iterations) {
+                GB_advance_cycles(gb, iterations * loop->cycles);
+                replayed_cycles += iterations * loop->cycles;
+                replayed_instructions += iterations * loop->n_instructions;
+                continue;
+            }
+        }
+        
+        unsigned end = i + 1 < loop->n_instructions? loop->instructions[i + 1].first_access : loop->n_accesses;
+        for (unsigned j = instruction->first_access; j < end; j++) {
+            if (loop->accesses[j].cycles) {
+                GB_advance_cycles(gb, loop->accesses[j].cycles);
+                replayed_cycles += loop->accesses[j].cycles;
+            }
+            if (!loop->accesses[j].polled) continue;
+            uint8_t value = GB_read_memory(gb, loop->accesses[j].address);
+            if (value != loop->accesses[j].value) {
+                /* The polled register changed, finish the load and resume normally */
+                memcpy(gb->registers, instruction->registers, sizeof(gb->registers));
+                gb->registers[GB_REGISTER_AF] = (gb->registers[GB_REGISTER_AF] & 0xFF) | (value << 8);
+                gb->pc = instruction->pc + (instruction_lengths[instruction->opcode] & ~BLOCK_END);
+                gb->last_opcode_read = instruction->opcode;
+                gb->pending_cycles = 4;
+                gb->debugger_idle_loop_ticks += replayed_cycles;
+                if (gb->counting_instructions) {
+                    gb->instruction_count += replayed_instructions + 1;
+                }
+                return true;
+            }
+        }
+        if (instruction->end_cycles) {
+            GB_advance_cycles(gb, instruction->end_cycles);
+            replayed_cycles += instruction->end_cycles;
+        }
+        replayed_instructions++;
+        if (++i == loop->n_instructions) {
+            i = 0;
+        }
+    }
+    if (!replayed_cycles) return false;
+    
+    memcpy(gb->registers, loop->instructions[i].registers, sizeof(gb->registers));
+    gb->pc = loop->instructions[i].pc;
+    gb->last_opcode_read = loop->instructions[(i? i : loop->n_instructions) - 1].opcode;
+    gb->debugger_idle_loop_ticks += replayed_cycles;
+    if (gb->counting_instructions) {
+        gb->instruction_count += replayed_instructions;
+    }
+    return true;
+}
+
+/* Called at the start of every instruction while a loop is armed, recorded or active; returns true if the loop was
+   replayed instead */
+static bool idle_loop_instruction_start(GB_gameboy_t *gb)
+{
+    struct GB_idle_loop_s *loop = gb->idle_loop;
+    if (gb->pc != gb->idle_loop_address) {
+        if (gb->idle_loop_state == GB_IDLE_LOOP_RECORDING) {
+            idle_loop_record_instruction(gb);
+        }
+        return false;
+    }
+    
+    switch ((GB_idle_loop_state_t)gb->idle_loop_state) {
+        case GB_IDLE_LOOP_NONE:
+            return false;
+        case GB_IDLE_LOOP_RECORDING: {
+            /* An iteration ended, it must have been fully recorded and end where it started */
+            unsigned cycles = 0;
+            for (unsigned i = 0; i < loop->n_instructions; i++) {
+                cycles += loop->instructions[i].cycles;
+            }
+            if (gb->debugger_ticks - loop->start_ticks != cycles) {
+                reject_idle_loop(gb);
+                return false;
+            }
+            if (!memcmp(gb->registers, loop->instructions[0].registers, sizeof(gb->registers)) &&
+                gb->ime == loop->instructions[0].ime) {
+                loop->cycles = cycles;
+                gb->idle_loop_state = GB_IDLE_LOOP_ACTIVE;
+                return idle_loop_replay(gb);
+            }
+            if (++loop->attempts == GB_IDLE_LOOP_MAX_ATTEMPTS) {
+                reject_idle_loop(gb);
+                return false;
+            }
+        }
+        /* Fall through */
+        case GB_IDLE_LOOP_ARMED:
+            gb->idle_loop_state = GB_IDLE_LOOP_RECORDING;
+            loop->n_instructions = 0;
+            loop->n_accesses = 0;
+            loop->start_ticks = gb->debugger_ticks;
+            idle_loop_record_instruction(gb);
+            return false;
+        case GB_IDLE_LOOP_ACTIVE:
+            return idle_loop_replay(gb);
+    }
+    return false;
+}
+
+/* Fetches the next opcode, through the current code block when the cached interpreter is enabled */
+static inline uint8_t fetch_opcode(GB_gameboy_t *gb)
+{
+    if (gb->code_blocks) {
+        GB_code_block_t *block = gb->current_code_block;
+        if (!block || (uint16_t)(gb->pc - block->address) >= block->length || gb->n_watchpoints) {
+            gb->current_code_block = find_code_block(gb, gb->pc);
+        }
+    }
+    gb->last_opcode_read = cycle_fetch(gb, gb->pc++);
+    if (gb->halt_bug) {
+        gb->pc--;
+        gb->halt_bug = false;
+    }
+    return gb->last_opcode_read;
+}
+
+/* Called after executing the instruction at address */
+static inline void instruction_executed(GB_gameboy_t *gb, uint16_t address)
+{
+    if (gb->counting_instructions) {
+        gb->instruction_count++;
+    }
+    if (gb->pc <= address && address - gb->pc <= GB_IDLE_LOOP_MAX_LENGTH && gb->idle_loop_detection) {
+        idle_loop_backward_jump(gb);
+    }
+}
+
+#ifdef GB_THREADED_DISPATCH
+/* Returns true if the next instruction can run right away, after pending cycles were flushed. That's the case when
+   neither GB_run nor the start of GB_cpu_run would do anything but fetch it: no interrupt, HALT, STOP, HDMA, EI
+   delay, frame end, debugger or SGB intro to service, and enough of GB_run's 8-bit cycle count left for another
+   instruction (see halt_can_fast_forward). */
+static inline bool threaded_dispatch_can_continue(GB_gameboy_t *gb)
+{
+    if (gb->halted || gb->stopped || gb->hdma_on || gb->ime_toggle || gb->vblank_just_occured) return false;
+    if (gb->ime && (gb->interrupt_enable & gb->io_registers[GB_IO_IF] & 0x1F)) return false;
+    if (!gb->debug_disable &&
+        (gb->n_breakpoints || gb->debug_stopped || gb->debug_next_command || gb->debug_fin_command)) return false;
+    if (gb->sgb && gb->sgb->intro_animation < 140) return false;
+    return gb->cycles_since_run <= 0xFF - (24 << !gb->cgb_double_speed);
+}
+
+#define OPCODE_LABEL(n) &&opcode_##n,
+#define CB_OPCODE_LABEL(n) &&cb_opcode_##n,
+#define THREADED_DISPATCH_NEXT() \
+    instruction_executed(gb, address); \
+    if (gb->hdma_starting || gb->idle_loop_state != GB_IDLE_LOOP_NONE) goto instruction_end; \
+    flush_pending_cycles(gb); \
+    if (!threaded_dispatch_can_continue(gb)) goto instruction_flushed; \
+    address = gb->pc; \
+    goto *labels[fetch_opcode(gb)];
+/* The CB prefix is dispatched to the CB-prefixed opcodes' labels rather than through cb_prefix */
+#define OPCODE_TARGET(n) opcode_##n: \
+    if (0x##n == 0xCB) goto *cb_labels[cycle_fetch(gb, gb->pc++)]; \
+    opcodes[0x##n](gb, 0x##n); \
+    THREADED_DISPATCH_NEXT()
+#define CB_OPCODE_TARGET(n) cb_opcode_##n: \
+    cb_opcodes[0x##n >> 3](gb, 0x##n); \
+    THREADED_DISPATCH_NEXT()
+#endif
+
+/* A halted CPU only advances the other units and samples interrupts. Rather than returning to GB_run every few
+   cycles, it skips ahead to the next event that matters (see GB_skippable_cycles) and keeps stepping until an
+   enabled interrupt is requested, a frame ends, HDMA starts, or GB_run's 8-bit cycle count could overflow; a step
+   that wakes the CPU and dispatches an interrupt takes up to 24 cycles. Timing is identical to separate calls. */
+static bool halt_can_fast_forward(GB_gameboy_t *gb)
+{
+    if (!gb->halted || gb->hdma_on || gb->vblank_just_occured || gb->debug_stopped) return false;
+    if (gb->interrupt_enable & gb->io_registers[GB_IO_IF] & 0x1F) return false;
+    return gb->cycles_since_run <= 0xFF - (24 << !gb->cgb_double_speed);
+}
+
 void GB_cpu_run(GB_gameboy_t *gb)
 {
+halt_fast_forward:
     if (gb->hdma_on) {
-        GB_advance_cycles(gb, 4);
+        uint8_t skipped_cycles = GB_skippable_hdma_cycles(gb);
+        GB_advance_cycles(gb, skipped_cycles? skipped_cycles : 4);
         return;
     }
     if (gb->stopped) {
@@ -1393,6 +2026,13 @@ void GB_cpu_run(GB_gameboy_t *gb)
         return;
     }
     
+    if (gb->halted && !gb->just_halted) {
+        uint8_t skipped_cycles = GB_skippable_cycles(gb);
+        if (skipped_cycles) {
+            GB_advance_cycles(gb, skipped_cycles);
+        }
+    }
+    
     if (gb->halted && !GB_is_cgb(gb) && !gb->just_halted) {
         GB_advance_cycles(gb, 2);
     }
@@ -1418,6 +2058,7 @@ void GB_cpu_run(GB_gameboy_t *gb)
     /* Call interrupt */
     else if (effecitve_ime && interrupt_queue) {
         gb->halted = false;
+        gb->idle_loop_state = GB_IDLE_LOOP_NONE;
         uint16_t call_addr = gb->pc;
         
         cycle_no_access(gb);
@@ -1453,19 +2094,36 @@ void GB_cpu_run(GB_gameboy_t *gb)
         GB_debugger_call_hook(gb, call_addr);
     }
     /* Run mode */
-    else if(!gb->halted) {
-        gb->last_opcode_read = cycle_read_inc_oam_bug(gb, gb->pc++);
-        if (gb->halt_bug) {
-            gb->pc--;
-            gb->halt_bug = false;
-        }
-        opcodes[gb->last_opcode_read](gb, gb->last_opcode_read);
+    else if (!gb->halted && !(gb->idle_loop_state && idle_loop_instruction_start(gb))) {
+        uint16_t address = gb->pc;
+#ifdef GB_THREADED_DISPATCH
+        static const void *const labels[256] = {FOR_EACH_OPCODE(OPCODE_LABEL)};
+        static const void *const cb_labels[256] = {FOR_EACH_OPCODE(CB_OPCODE_LABEL)};
+        goto *labels[fetch_opcode(gb)];
+        FOR_EACH_OPCODE(OPCODE_TARGET)
+        FOR_EACH_OPCODE(CB_OPCODE_TARGET)
+#else
+        uint8_t opcode = fetch_opcode(gb);
+        opcodes[opcode](gb, opcode);
+        instruction_executed(gb, address);
+#endif
     }
     
+#ifdef GB_THREADED_DISPATCH
+instruction_end:
+#endif
     if (gb->hdma_starting) {
         gb->hdma_starting = false;
         gb->hdma_on = true;
         gb->hdma_cycles = -8;
     }
+    if (gb->idle_loop_state == GB_IDLE_LOOP_RECORDING) {
+        idle_loop_record_end(gb);
+    }
     flush_pending_cycles(gb);
+    
+#ifdef GB_THREADED_DISPATCH
+instruction_flushed:
+#endif
+    if (halt_can_fast_forward(gb)) goto halt_fast_forward;
 }
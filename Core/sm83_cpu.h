@@ -1,11 +1,34 @@
 #ifndef sm83_cpu_h
 #define sm83_cpu_h
 #include "gb_struct_def.h"
+#include <stdbool.h>
 #include <stdint.h>
 
 void GB_cpu_disassemble(GB_gameboy_t *gb, uint16_t pc, uint16_t count);
+/* Predecodes ROM and WRAM code into cached blocks. Emulation results are identical, but ROM and RAM must only be
+   modified through the emulated bus (GB_write_memory), not through pointers from GB_get_direct_access. */
+void GB_set_cached_interpreter_enabled(GB_gameboy_t *gb, bool enabled);
+/* Replays idle polling loops instead of running them instruction by instruction, enabled by default. Emulation
+   results are identical. The memory a loop reads is checked again every time GB_run starts replaying it, so it may
+   be modified through pointers from GB_get_direct_access between GB_run calls, but not from callbacks called while
+   a loop is replayed. */
+void GB_set_idle_loop_detection(GB_gameboy_t *gb, bool enabled);
+/* Counts executed instructions, including replayed idle loop iterations. Enabling resets the count. */
+void GB_set_instruction_counting(GB_gameboy_t *gb, bool enabled);
+uint64_t GB_get_instruction_count(GB_gameboy_t *gb);
 #ifdef GB_INTERNAL
+typedef struct GB_code_block_s GB_code_block_t;
+
+typedef enum {
+    GB_IDLE_LOOP_NONE,
+    GB_IDLE_LOOP_ARMED, // A short backward jump was taken, record the loop next time it starts
+    GB_IDLE_LOOP_RECORDING,
+    GB_IDLE_LOOP_ACTIVE, // The recorded iteration can be replayed
+} GB_idle_loop_state_t;
+
 void GB_cpu_run(GB_gameboy_t *gb);
+void GB_cpu_flush_code_blocks(GB_gameboy_t *gb);
+void GB_cpu_invalidate_ram_code(GB_gameboy_t *gb, uint16_t offset); /* Offset into gb->ram */
 #endif
 
 #endif /* sm83_cpu_h */
@@ -5,22 +5,30 @@
 #endif
 #include <Windows.h>
 #else
-#include <sys/time.h>
+#include <time.h>
 #endif
 
 static const unsigned int GB_TAC_TRIGGER_BITS[] = {512, 8, 32, 128};
 
 #ifndef DISABLE_TIMEKEEPING
+/* Sleeping may overshoot by a millisecond or more on a loaded host, so the last part of a wait is spent spinning */
+#define SPIN_NANOSECONDS 1000000
+
 static int64_t get_nanoseconds(void)
 {
 #ifndef _WIN32
-    struct timeval now;
-    gettimeofday(&now, NULL);
-    return (now.tv_usec) * 1000 + now.tv_sec * 1000000000L;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_nsec + now.tv_sec * 1000000000LL;
 #else
-    FILETIME time;
-    GetSystemTimeAsFileTime(&time);
-    return (((int64_t)time.dwHighDateTime << 32) | time.dwLowDateTime) * 100L;
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (!frequency.QuadPart) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart / frequency.QuadPart * 1000000000LL +
+           counter.QuadPart % frequency.QuadPart * 1000000000LL / frequency.QuadPart;
 #endif
 }
 
@@ -40,6 +48,28 @@ static void nsleep(uint64_t nanoseconds)
 #endif
 }
 
+/* Returns the time it woke up at */
+static int64_t sleep_until(int64_t deadline)
+{
+    int64_t nanoseconds = get_nanoseconds();
+    if (deadline - nanoseconds > SPIN_NANOSECONDS) {
+        nsleep(deadline - nanoseconds - SPIN_NANOSECONDS);
+    }
+    while ((nanoseconds = get_nanoseconds()) < deadline);
+    return nanoseconds;
+}
+
+static void record_lateness(GB_gameboy_t *gb, uint64_t lateness)
+{
+    gb->paced_frames++;
+    gb->total_lateness += lateness;
+    if (lateness > gb->max_lateness) {
+        gb->max_lateness = lateness;
+    }
+    unsigned bucket = lateness / GB_LATENESS_BUCKET_NANOSECONDS;
+    gb->lateness_histogram[MIN(bucket, GB_LATENESS_BUCKETS - 1)]++;
+}
+
 bool GB_timing_sync_turbo(GB_gameboy_t *gb)
 {
     if (!gb->turbo_dont_skip) {
@@ -62,13 +92,19 @@ void GB_timing_sync(GB_gameboy_t *gb)
     if (gb->cycles_since_last_sync < LCDC_PERIOD / 4) return;
 
     uint64_t target_nanoseconds = gb->cycles_since_last_sync * 1000000000LL / 2 / GB_get_clock_rate(gb); /* / 2 because we use 8MHz units */
+    int64_t frame_nanoseconds = LCDC_PERIOD * 1000000000LL / GB_get_clock_rate(gb);
     int64_t nanoseconds = get_nanoseconds();
     int64_t time_to_sleep = target_nanoseconds + gb->last_sync - nanoseconds;
-    if (time_to_sleep > 0 && time_to_sleep < LCDC_PERIOD * 1000000000LL / GB_get_clock_rate(gb)) {
-        nsleep(time_to_sleep);
+    if (time_to_sleep > 0 && time_to_sleep < frame_nanoseconds) {
         gb->last_sync += target_nanoseconds;
+        record_lateness(gb, sleep_until(gb->last_sync) - gb->last_sync);
     }
     else {
+        /* Running behind. Being more than a frame off either way is a discontinuity, such as a pause, rather than
+           bad pacing. */
+        if (time_to_sleep > -frame_nanoseconds && time_to_sleep <= 0) {
+            record_lateness(gb, -time_to_sleep);
+        }
         gb->last_sync = nanoseconds;
     }
 
@@ -86,6 +122,35 @@ void GB_timing_sync(GB_gameboy_t *gb)
 }
 
 #endif
+
+void GB_get_frame_pacing_statistics(GB_gameboy_t *gb, GB_frame_pacing_statistics_t *statistics)
+{
+    statistics->frames = gb->paced_frames;
+    statistics->mean_lateness = gb->paced_frames? gb->total_lateness / gb->paced_frames : 0;
+    statistics->max_lateness = gb->max_lateness;
+    
+    /* Upper bound of the bucket the 99th percentile falls in */
+    statistics->p99_lateness = 0;
+    uint64_t remaining = gb->paced_frames - gb->paced_frames * 99 / 100;
+    for (unsigned i = GB_LATENESS_BUCKETS; i-- && remaining;) {
+        if (gb->lateness_histogram[i] >= remaining) {
+            /* The last bucket also counts anything later than it */
+            statistics->p99_lateness = i == GB_LATENESS_BUCKETS - 1? gb->max_lateness :
+                                       MIN((uint64_t)(i + 1) * GB_LATENESS_BUCKET_NANOSECONDS, gb->max_lateness);
+            break;
+        }
+        remaining -= gb->lateness_histogram[i];
+    }
+}
+
+void GB_reset_frame_pacing_statistics(GB_gameboy_t *gb)
+{
+    gb->paced_frames = 0;
+    gb->total_lateness = 0;
+    gb->max_lateness = 0;
+    memset(gb->lateness_histogram, 0, sizeof(gb->lateness_histogram));
+}
+
 static void GB_ir_run(GB_gameboy_t *gb)
 {
     if (gb->ir_queue_length == 0) return;
@@ -134,6 +199,37 @@ static void GB_set_internal_div_counter(GB_gameboy_t *gb, uint32_t value)
     gb->div_counter = value;
 }
 
+/* Returns how many 4-cycle DIV steps it takes for bit to fall */
+static unsigned steps_until_div_edge(GB_gameboy_t *gb, unsigned bit)
+{
+    return (bit * 2 - (gb->div_counter & (bit * 2 - 1))) / 4;
+}
+
+/* When several DIV steps are due at once, e.g. after a halted CPU skipped ahead, all but the last one are applied
+   in closed form, up to the first step that would overflow TIMA, clock the APU's frame sequencer or advance the TIMA
+   reload. The remaining steps run normally. */
+static void advance_quiet_div_steps(GB_gameboy_t *gb)
+{
+    if (gb->div_cycles <= 4 || gb->tima_reload_state != GB_TIMA_RUNNING) return;
+    
+    int32_t steps = (gb->div_cycles + 3) / 4 - 1;
+    steps = MIN(steps, (int32_t)steps_until_div_edge(gb, gb->cgb_double_speed? 0x2000 : 0x1000) - 1);
+    unsigned bit = 0;
+    if (gb->io_registers[GB_IO_TAC] & 4) {
+        bit = GB_TAC_TRIGGER_BITS[gb->io_registers[GB_IO_TAC] & 3];
+        steps = MIN(steps, (int32_t)(steps_until_div_edge(gb, bit) - 1 + (0xFF - gb->io_registers[GB_IO_TIMA]) * bit / 2));
+    }
+    if (steps <= 0) return;
+    
+    uint32_t counter = gb->div_counter + steps * 4;
+    if (bit) {
+        gb->io_registers[GB_IO_TIMA] += counter / (bit * 2) - gb->div_counter / (bit * 2);
+    }
+    gb->div_counter = counter & (INTERNAL_DIV_CYCLES - 1);
+    gb->apu.apu_cycles += steps * (4 << !gb->cgb_double_speed);
+    gb->div_cycles -= steps * 4;
+}
+
 static void GB_timers_run(GB_gameboy_t *gb, uint8_t cycles)
 {
     GB_STATE_MACHINE(gb, div, cycles, 1) {
@@ -146,6 +242,7 @@ static void GB_timers_run(GB_gameboy_t *gb, uint8_t cycles)
 main:
     GB_SLEEP(gb, div, 1, 3);
     while (true) {
+        advance_quiet_div_steps(gb);
         advance_tima_state_machine(gb);
         GB_set_internal_div_counter(gb, gb->div_counter + 4);
         gb->apu.apu_cycles += 4 << !gb->cgb_double_speed;
@@ -207,11 +304,26 @@ static void advance_serial(GB_gameboy_t *gb, uint8_t cycles)
 
 void GB_advance_cycles(GB_gameboy_t *gb, uint8_t cycles)
 {   
+    /* Every unit keeps track of when its next event is due (state machines via their cycles counter, the rest
+       via their own counters and flags), so only units with a due event are dispatched. Units that are not due
+       only get their counters advanced, which keeps timing identical to running them unconditionally.
+       These checks are not replaced by a single compare against the earliest deadline of all units: the DIV state
+       machine has an event due every 4 cycles, which is nearly every call, so that compare would almost never
+       skip anything while keeping the earliest deadline up to date costs more than the checks themselves. */
+    
     // Affected by speed boost
     gb->dma_cycles += cycles;
 
-    GB_timers_run(gb, cycles);
-    advance_serial(gb, cycles);
+    if (GB_STATE_MACHINE_ADVANCE(gb, div, cycles)) {
+        GB_timers_run(gb, 0);
+    }
+    
+    if (gb->serial_length) {
+        advance_serial(gb, cycles);
+    }
+    else {
+        gb->serial_cycles += cycles;
+    }
 
     gb->debugger_ticks += cycles;
 
@@ -222,16 +334,116 @@ void GB_advance_cycles(GB_gameboy_t *gb, uint8_t cycles)
     // Not affected by speed boost
     gb->double_speed_alignment += cycles;
     gb->hdma_cycles += cycles;
-    gb->apu_output.sample_cycles += cycles;
+    gb->apu_output.sample_cycles += (uint64_t)cycles << 32;
     gb->cycles_since_ir_change += cycles;
     gb->cycles_since_input_ir_change += cycles;
     gb->cycles_since_last_sync += cycles;
     gb->cycles_since_run += cycles;
-    GB_dma_run(gb);
-    GB_hdma_run(gb);
-    GB_apu_run(gb);
-    GB_display_run(gb, cycles);
-    GB_ir_run(gb);
+    if (gb->rtc_mode == GB_RTC_MODE_ACCURATE) {
+        /* GB_rtc_run also runs every VBlank, this keeps the count from overflowing while the LCD is off */
+        if ((gb->rtc_cycles += cycles) >= 0x10000000) {
+            GB_rtc_run(gb);
+        }
+    }
+    
+    if (gb->dma_steps_left && gb->dma_cycles >= 4) {
+        GB_dma_run(gb);
+    }
+    if (gb->hdma_on && gb->hdma_cycles >= 4) {
+        GB_hdma_run(gb);
+    }
+    /* apu_cycles is only ever increased by the DIV state machine, the APU has nothing to do otherwise. */
+    if (gb->apu.apu_cycles) {
+        GB_apu_run(gb);
+    }
+    if (GB_STATE_MACHINE_ADVANCE(gb, display, cycles)) {
+        GB_display_run(gb, 0);
+    }
+    if (gb->ir_queue_length) {
+        GB_ir_run(gb);
+    }
+}
+
+/* Cycles until the DIV state machine causes a falling edge on the given bit of the internal DIV counter */
+static int32_t cycles_until_div_edge(GB_gameboy_t *gb, uint16_t bit)
+{
+    unsigned ticks = (bit * 2 - (gb->div_counter & (bit * 2 - 1))) / 4;
+    return 1 - gb->div_cycles + (ticks - 1) * 4;
+}
+
+/* Returns how many cycles can be advanced with a single GB_advance_cycles call rather than several smaller ones,
+   e.g. by a halted CPU. The skipped cycles never include an enabled interrupt being requested, VBlank, an APU
+   event or channel change, or a rendered sample, so skipping them is identical to stepping through them. Other
+   registers, such as LY and STAT, may change. The result leaves room in GB_run's 8-bit cycle count for a following
+   step that dispatches an interrupt. Doesn't account for HDMA. */
+static int32_t skippable_cycles(GB_gameboy_t *gb)
+{
+    if (gb->dma_steps_left || gb->serial_length || gb->ir_queue_length) return 0;
+    if (gb->interrupt_enable & gb->io_registers[GB_IO_IF] & 0x1F) return 0;
+    if (gb->div_state != 2) return 0;
+    
+    uint8_t speed_shift = !gb->cgb_double_speed;
+    int32_t cycles = ((0xFF - gb->cycles_since_run) >> speed_shift) - 24;
+    
+    /* apu_cycles can't hold more */
+    cycles = MIN(cycles, 0xFF >> speed_shift);
+    cycles = MIN(cycles, (int32_t)(GB_display_uneventful_cycles(gb) >> speed_shift));
+    cycles = MIN(cycles, (int32_t)(GB_apu_batchable_cycles(gb) >> speed_shift));
+    cycles = MIN(cycles, cycles_until_div_edge(gb, gb->cgb_double_speed? 0x2000 : 0x1000) - 1);
+    
+    if ((gb->interrupt_enable & 4) && (gb->io_registers[GB_IO_TAC] & 4)) {
+        if (gb->tima_reload_state != GB_TIMA_RUNNING) return 0;
+        uint16_t bit = GB_TAC_TRIGGER_BITS[gb->io_registers[GB_IO_TAC] & 3];
+        cycles = MIN(cycles, cycles_until_div_edge(gb, bit) + (0xFF - gb->io_registers[GB_IO_TIMA]) * bit * 2 - 1);
+    }
+    
+    return cycles;
+}
+
+uint8_t GB_skippable_cycles(GB_gameboy_t *gb)
+{
+    if (gb->hdma_on || gb->hdma_starting) return 0;
+    int32_t cycles = skippable_cycles(gb);
+    
+    if (cycles < 4) return 0;
+    return cycles & ~3;
+}
+
+/* Like GB_skippable_cycles, but for a CPU stalled by an HDMA transfer. The skipped cycles end with the 4-cycle step
+   that completes the current block, and the display doesn't run during them so VRAM stays (un)blocked. Only used
+   when the source is in the page table, whose contents don't depend on the skipped cycles. */
+uint8_t GB_skippable_hdma_cycles(GB_gameboy_t *gb)
+{
+    if (!gb->hdma_on || gb->n_watchpoints || gb->display_cycles > 0 || !gb->read_pages[gb->hdma_current_src >> 8]) return 0;
+    int32_t cycles = skippable_cycles(gb);
+    
+    uint8_t speed_shift = !gb->cgb_double_speed;
+    cycles = MIN(cycles, -gb->display_cycles >> speed_shift);
+    int32_t block_cycles = (0x10 - (gb->hdma_current_dest & 0xF)) * 4 - gb->hdma_cycles; // In 8MHz units
+    cycles = MIN(cycles, (((block_cycles + speed_shift) >> speed_shift) + 3) & ~3);
+    
+    if (cycles < 4) return 0;
+    return cycles & ~3;
+}
+
+/* Like GB_skippable_cycles, but the skipped cycles also keep IF, LY and STAT unchanged, so they can be skipped by
+   a CPU polling them as well */
+uint8_t GB_skippable_polling_cycles(GB_gameboy_t *gb)
+{
+    int32_t cycles = GB_skippable_cycles(gb);
+    if (!cycles || gb->display_cycles > 0) return 0;
+    
+    /* LY, STAT and the display's interrupts only change when the display state machine runs */
+    cycles = MIN(cycles, -gb->display_cycles >> !gb->cgb_double_speed);
+    
+    if (gb->io_registers[GB_IO_TAC] & 4) {
+        if (gb->tima_reload_state != GB_TIMA_RUNNING) return 0;
+        uint16_t bit = GB_TAC_TRIGGER_BITS[gb->io_registers[GB_IO_TAC] & 3];
+        cycles = MIN(cycles, cycles_until_div_edge(gb, bit) + (0xFF - gb->io_registers[GB_IO_TIMA]) * bit * 2 - 1);
+    }
+    
+    if (cycles < 4) return 0;
+    return cycles & ~3;
 }
 
 /* 
@@ -256,32 +468,54 @@ void GB_emulate_timer_glitch(GB_gameboy_t *gb, uint8_t old_tac, uint8_t new_tac)
     }
 }
 
+/* Counts up a wrapping RTC register, which like the hardware only wraps from modulo - 1 to 0, so an out of range value
+   first counts up to 0xFF and overflows to 0. Returns how many times it wrapped. */
+static uint64_t advance_rtc_register(uint8_t *value, uint64_t increments, uint8_t modulo)
+{
+    unsigned until_wrap = *value < modulo? modulo - *value : 0x100 - *value + modulo;
+    if (increments < until_wrap) {
+        *value += increments;
+        return 0;
+    }
+    increments -= until_wrap;
+    *value = increments % modulo;
+    return 1 + increments / modulo;
+}
+
+static void advance_rtc(GB_gameboy_t *gb, uint64_t seconds)
+{
+    uint64_t minutes = advance_rtc_register(&gb->rtc_real.seconds, seconds, 60);
+    if (!minutes) return;
+    uint64_t hours = advance_rtc_register(&gb->rtc_real.minutes, minutes, 60);
+    if (!hours) return;
+    uint64_t days = advance_rtc_register(&gb->rtc_real.hours, hours, 24);
+    if (!days) return;
+    
+    days += gb->rtc_real.days | ((gb->rtc_real.high & 1) << 8); /* Bit 8 of days*/
+    if (days >= 0x200) {
+        gb->rtc_real.high |= 0x80; /* Overflow bit */
+    }
+    gb->rtc_real.days = days;
+    gb->rtc_real.high = (gb->rtc_real.high & ~1) | ((days >> 8) & 1);
+}
+
 void GB_rtc_run(GB_gameboy_t *gb)
 {
+    if (gb->rtc_mode == GB_RTC_MODE_ACCURATE) {
+        uint32_t cycles_per_second = GB_get_unmultiplied_clock_rate(gb) * 2; /* In 8MHz units */
+        uint32_t seconds = gb->rtc_cycles / cycles_per_second;
+        gb->rtc_cycles %= cycles_per_second;
+        if ((gb->rtc_real.high & 0x40) == 0) { /* is timer running? */
+            advance_rtc(gb, seconds);
+        }
+        return;
+    }
+    
     if ((gb->rtc_real.high & 0x40) == 0) { /* is timer running? */
         time_t current_time = time(NULL);
-        while (gb->last_rtc_second < current_time) {
-            gb->last_rtc_second++;
-            if (++gb->rtc_real.seconds == 60)
-            {
-                gb->rtc_real.seconds = 0;
-                if (++gb->rtc_real.minutes == 60)
-                {
-                    gb->rtc_real.minutes = 0;
-                    if (++gb->rtc_real.hours == 24)
-                    {
-                        gb->rtc_real.hours = 0;
-                        if (++gb->rtc_real.days == 0)
-                        {
-                            if (gb->rtc_real.high & 1) /* Bit 8 of days*/
-                            {
-                                gb->rtc_real.high |= 0x80; /* Overflow bit */
-                            }
-                            gb->rtc_real.high ^= 1;
-                        }
-                    }
-                }
-            }
+        if (gb->last_rtc_second < current_time) {
+            advance_rtc(gb, current_time - gb->last_rtc_second);
+            gb->last_rtc_second = current_time;
         }
     }
 }
@@ -1,9 +1,28 @@
 #ifndef timing_h
 #define timing_h
 #include "gb_struct_def.h"
+#include <stdint.h>
+
+/* How late GB_timing_sync woke up compared to when each frame was due, in nanoseconds. p99_lateness is rounded up
+   to GB_LATENESS_BUCKET_NANOSECONDS. Lateness only counts frames that were paced, not turbo mode or pauses. */
+typedef struct {
+    uint64_t frames;
+    uint64_t mean_lateness;
+    uint64_t p99_lateness;
+    uint64_t max_lateness;
+} GB_frame_pacing_statistics_t;
+
+void GB_get_frame_pacing_statistics(GB_gameboy_t *gb, GB_frame_pacing_statistics_t *statistics);
+void GB_reset_frame_pacing_statistics(GB_gameboy_t *gb);
+
+#define GB_LATENESS_BUCKETS 0x100
+#define GB_LATENESS_BUCKET_NANOSECONDS 16000
 
 #ifdef GB_INTERNAL
 void GB_advance_cycles(GB_gameboy_t *gb, uint8_t cycles);
+uint8_t GB_skippable_cycles(GB_gameboy_t *gb);
+uint8_t GB_skippable_polling_cycles(GB_gameboy_t *gb);
+uint8_t GB_skippable_hdma_cycles(GB_gameboy_t *gb);
 void GB_rtc_run(GB_gameboy_t *gb);
 void GB_emulate_timer_glitch(GB_gameboy_t *gb, uint8_t old_tac, uint8_t new_tac);
 bool GB_timing_sync_turbo(GB_gameboy_t *gb); /* Returns true if should skip frame */
@@ -35,6 +54,11 @@ if ((gb)->unit##_cycles <= 0 || (gb)->unit##_cycles == GB_HALT_VALUE) {\
     return;\
 }\
 switch ((gb)->unit##_state)
+
+/* Advances a state machine's cycle counter without running it. Evaluates to true if the state machine has an event
+   due, in which case it should be run with 0 additional cycles. */
+#define GB_STATE_MACHINE_ADVANCE(gb, unit, cycles) \
+(((gb)->unit##_cycles += (cycles)) > 0 && (gb)->unit##_cycles != GB_HALT_VALUE)
 #endif
 
 #define GB_STATE(gb, unit, state) case state: goto unit##state
@@ -443,6 +443,7 @@ restart:
         GB_set_vblank_callback(&gb, (GB_vblank_callback_t) vblank);
         GB_set_pixels_output(&gb, active_pixel_buffer);
         GB_set_bg_pixels_output(&gb, bg_pixel_buffer);
+        GB_set_line_cache_enabled(&gb, true);
         GB_set_rgb_encode_callback(&gb, gb_rgb_encode);
         GB_set_sample_rate(&gb, have_aspec.freq);
         GB_set_color_correction_mode(&gb, configuration.color_correction_mode);
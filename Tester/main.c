@@ -227,7 +227,7 @@ int main(int argc, char **argv)
     fprintf(stderr, "SameBoy Tester v" xstr(VERSION) "\n");
 
     if (argc == 1) {
-        fprintf(stderr, "Usage: %s [--dmg] [--start] [--length seconds] [--boot path to boot ROM]"
+        fprintf(stderr, "Usage: %s [--dmg] [--start] [--length seconds] [--boot path to boot ROM] [--cached-interpreter] [--benchmark]"
 #ifndef _WIN32
                         " [--jobs number of tests to run simultaneously]"
 #endif
@@ -241,6 +241,8 @@ int main(int argc, char **argv)
 #endif
 
     bool dmg = false;
+    bool cached_interpreter = false;
+    bool benchmark = false;
     const char *boot_rom_path = NULL;
 
     for (unsigned i = 1; i < argc; i++) {
@@ -262,6 +264,18 @@ int main(int argc, char **argv)
             continue;
         }
         
+        if (strcmp(argv[i], "--cached-interpreter") == 0) {
+            fprintf(stderr, "Using the cached interpreter\n");
+            cached_interpreter = true;
+            continue;
+        }
+        
+        if (strcmp(argv[i], "--benchmark") == 0) {
+            fprintf(stderr, "Measuring instructions per second\n");
+            benchmark = true;
+            continue;
+        }
+        
         if (strcmp(argv[i], "--boot") == 0 && i != argc - 1) {
             fprintf(stderr, "Using boot ROM %s\n", argv[i + 1]);
             boot_rom_path = argv[++i];
@@ -322,6 +336,7 @@ int main(int argc, char **argv)
         GB_set_rgb_encode_callback(&gb, rgb_encode);
         GB_set_log_callback(&gb, log_callback);
         GB_set_async_input_callback(&gb, async_input_callback);
+        GB_set_cached_interpreter_enabled(&gb, cached_interpreter);
         
         if (GB_load_rom(&gb, filename)) {
             perror("Failed to load ROM");
@@ -367,6 +382,8 @@ int main(int argc, char **argv)
         running = true;
         gb.turbo = gb.turbo_dont_skip = gb.disable_rendering = true;
         frames = 0;
+        GB_set_instruction_counting(&gb, benchmark);
+        clock_t start_time = clock();
         while (running) {
             GB_run(&gb);
             /* This early crash test must not run in vblank because PC might not point to the next instruction. */
@@ -376,6 +393,13 @@ int main(int argc, char **argv)
             }
         }
         
+        if (benchmark) {
+            double seconds = (clock() - start_time) / (double)CLOCKS_PER_SEC;
+            uint64_t instructions = GB_get_instruction_count(&gb);
+            fprintf(stderr, "%s: %llu instructions in %.2f seconds, %.2f million instructions per second\n",
+                    filename, (unsigned long long)instructions, seconds, instructions / seconds / 1000000);
+        }
+        
         if (log_file) {
             fclose(log_file);
             log_file = NULL;
@@ -96,6 +96,7 @@ static unsigned screen_layout = 0;
 static unsigned audio_out = 0;
 
 static bool geometry_updated = false;
+static bool can_dupe = false;
 static bool link_cable_emulation = false;
 /*static bool infrared_emulation   = false;*/
 
@@ -886,8 +887,12 @@ void retro_run(void)
     }
     else
     {
+        uint32_t dirty_lines[GB_DIRTY_LINES_WORDS];
         if (model[0] == MODEL_SGB || model[0] == MODEL_SGB2)
             video_cb(frame_buf, SGB_VIDEO_WIDTH, SGB_VIDEO_HEIGHT, SGB_VIDEO_WIDTH * sizeof(uint32_t));
+        /* Let the frontend present the previous frame again if no line changed */
+        else if (can_dupe && !GB_get_dirty_lines(&gameboy[0], dirty_lines))
+            video_cb(NULL, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_WIDTH * sizeof(uint32_t));
         else
             video_cb(frame_buf, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_WIDTH * sizeof(uint32_t));
     }
@@ -917,6 +922,7 @@ bool retro_load_game(const struct retro_game_info *info)
     for (int i = 0; i < emulated_devices; i++)
     {
         init_for_current_model(i);
+        /* A private, writable copy; the ROM memory descriptor and cheats may write to it */
         if (GB_load_rom(&gameboy[i],info->path))
         {
             log_cb(RETRO_LOG_INFO, "Failed to load ROM at %s\n", info->path);
@@ -927,6 +933,9 @@ bool retro_load_game(const struct retro_game_info *info)
     bool achievements = true;
     environ_cb(RETRO_ENVIRONMENT_SET_SUPPORT_ACHIEVEMENTS, &achievements);
 
+    if (!environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &can_dupe))
+        can_dupe = false;
+
     if (environ_cb(RETRO_ENVIRONMENT_GET_RUMBLE_INTERFACE, &rumble))
         log_cb(RETRO_LOG_INFO, "Rumble environment supported\n");
     else